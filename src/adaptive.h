@@ -0,0 +1,113 @@
+#ifndef ADAPTIVE_H
+#define ADAPTIVE_H
+#include <stdio.h>
+#include <stdlib.h>
+#include "toneMapping.h"
+
+/* adaptive sampling. Every pixel keeps the running mean and variance of the luminance of
+its samples (Welford), and the image is sampled in square tiles. A tile is left out of
+the later passes once each of its pixels has at least ADAPTIVE_MIN_SAMPLES samples and the
+standard error of its mean is below the error threshold, relative to its brightness.
+Deciding per tile instead of per pixel keeps a pixel that happened to see the same
+value a few times from stopping while its neighbours are still noisy */
+#define ADAPTIVE_TILE 16         // pixels, width and height of a tile
+#define ADAPTIVE_MIN_SAMPLES 64
+#define ADAPTIVE_DARK 0.05f      // luminance added to the mean before dividing, so black pixels converge
+
+typedef struct {
+    int width, height;
+    int tiles_x, tiles_y;
+    int *active;       // tiles still sampled, in no particular order
+    int active_count;
+    int *converged;    // of every tile in active, set by check_tile
+    int *samples;      // of every pixel, in image order like the image buffer (rows from the bottom)
+    float *mean, *m2;  // of the luminance of every pixel and its sum of squared deviations
+} AdaptiveState;
+
+void init_adaptive(AdaptiveState *state, int width, int height) {
+    state->width = width;
+    state->height = height;
+    state->tiles_x = (width + ADAPTIVE_TILE - 1) / ADAPTIVE_TILE;
+    state->tiles_y = (height + ADAPTIVE_TILE - 1) / ADAPTIVE_TILE;
+    state->active_count = state->tiles_x * state->tiles_y;
+    state->active = malloc(state->active_count * sizeof(int));
+    state->converged = calloc(state->active_count, sizeof(int));
+    state->samples = calloc(width * height, sizeof(int));
+    state->mean = calloc(width * height, sizeof(float));
+    state->m2 = calloc(width * height, sizeof(float));
+    if (!state->active || !state->converged || !state->samples || !state->mean || !state->m2) {
+        fprintf(stderr, "Error: Memory allocation failed for the adaptive sampling\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < state->active_count; i++) {
+        state->active[i] = i;
+    }
+}
+
+void free_adaptive(AdaptiveState *state) {
+    free(state->active);
+    free(state->converged);
+    free(state->samples);
+    free(state->mean);
+    free(state->m2);
+}
+
+/* pixels x0 <= x < x1 and y0 <= y < y1 of the tile, in render coordinates */
+static inline void tile_bounds(AdaptiveState *state, int tile, int *x0, int *y0, int *x1, int *y1) {
+    *x0 = tile % state->tiles_x * ADAPTIVE_TILE;
+    *y0 = tile / state->tiles_x * ADAPTIVE_TILE;
+    *x1 = *x0 + ADAPTIVE_TILE < state->width ? *x0 + ADAPTIVE_TILE : state->width;
+    *y1 = *y0 + ADAPTIVE_TILE < state->height ? *y0 + ADAPTIVE_TILE : state->height;
+}
+
+/* index of pixel x, y in image order */
+static inline int image_pixel(AdaptiveState *state, int x, int y) {
+    return (state->height - y - 1) * state->width + x;
+}
+
+static inline void add_pixel_sample(AdaptiveState *state, int pixel, Vec3 value) {
+    float l = luminance(value);
+    int n = ++state->samples[pixel];
+    float delta = l - state->mean[pixel];
+    state->mean[pixel] += delta / n;
+    state->m2[pixel] += delta * (l - state->mean[pixel]);
+}
+
+/* standard error of the mean of the pixel relative to its brightness */
+static inline float pixel_error(AdaptiveState *state, int pixel) {
+    int n = state->samples[pixel];
+    if (n < 2) {
+        return INFINITY;
+    }
+    float variance = state->m2[pixel] / (n - 1);
+    return sqrtf(variance / n) / (state->mean[pixel] + ADAPTIVE_DARK);
+}
+
+/* 1 if every pixel of the tile is below max_error */
+int tile_converged(AdaptiveState *state, int tile, float max_error) {
+    int x0, y0, x1, y1;
+    tile_bounds(state, tile, &x0, &y0, &x1, &y1);
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+            int pixel = image_pixel(state, x, y);
+            if (state->samples[pixel] < ADAPTIVE_MIN_SAMPLES || pixel_error(state, pixel) >= max_error) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/* drops the tiles marked in converged from the active ones */
+void remove_converged_tiles(AdaptiveState *state) {
+    int kept = 0;
+    for (int i = 0; i < state->active_count; i++) {
+        if (!state->converged[i]) {
+            state->active[kept++] = state->active[i];
+        }
+        state->converged[i] = 0;
+    }
+    state->active_count = kept;
+}
+
+#endif // ADAPTIVE_H
@@ -0,0 +1,287 @@
+#ifndef BINARYSCENE_H
+#define BINARYSCENE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "mesh.h"
+
+/* Binary scene container written by tools/scene2bin.c. All sections hold the exact in-memory
+layout of the renderer (native endianness), start at 64 byte aligned offsets and are used in
+place from the mapped file, so loading does not touch the individual elements.
+
+    header | section table | positions | normals | texcoords | triangles | materials |
+    texture records | texel data of every texture (tiled, all mip levels)
+*/
+#define SCENE_MAGIC "TTSCENE"
+#define SCENE_VERSION 4
+#define SCENE_ALIGN 64
+
+enum {
+    SECTION_POSITIONS,
+    SECTION_NORMALS,
+    SECTION_TEXCOORDS,
+    SECTION_TRIANGLES,
+    SECTION_MATERIALS,
+    SECTION_TEXTURES,
+    SECTION_TEXELS,
+    SECTION_COUNT
+};
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t section_count;
+    uint32_t compressed_attributes; // COMPRESS_ATTRIBUTES of the writer, the layouts differ
+    uint32_t reserved[11];
+} SceneHeader;
+
+typedef struct {
+    uint64_t offset; // from the start of the file
+    uint64_t size;   // in bytes
+    uint32_t count;
+    uint32_t elem_size;
+} SceneSection;
+
+/* material property, texture is an index into the texture records or -1 */
+typedef struct {
+    Vec3 value;
+    int32_t texture;
+} ScenePropRecord;
+
+typedef struct {
+    char name[64];
+    ScenePropRecord props[PROP_COUNT]; // same order as in Material
+} SceneMaterialRecord;
+
+typedef struct {
+    int32_t width, height;
+    int32_t format; // TEX_* of the texels
+    int32_t reserved;
+    uint64_t offset; // into the texel section
+} SceneTextureRecord;
+
+static inline uint64_t scene_align(uint64_t offset) {
+    return (offset + SCENE_ALIGN - 1) / SCENE_ALIGN * SCENE_ALIGN;
+}
+
+void write_section(FILE *file, SceneSection *section, const void *data) {
+    static const char zeros[SCENE_ALIGN] = {0};
+    long pos = ftell(file);
+    fwrite(zeros, 1, section->offset - pos, file);
+    if (section->size > 0 && fwrite(data, 1, section->size, file) != section->size) {
+        fprintf(stderr, "Error: Unable to write scene section\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void write_binary_scene(const char *filename, Triangles *mesh, Materials *mats) {
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        fprintf(stderr, "Error: Unable to open file %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    // flatten the materials, every texture gets one record no matter how many properties share it
+    SceneMaterialRecord *mat_records = calloc(mats->material_count + 1, sizeof(SceneMaterialRecord));
+    SceneTextureRecord *tex_records = calloc(mats->material_count * PROP_COUNT + 1, sizeof(SceneTextureRecord));
+    Texture **textures = calloc(mats->material_count * PROP_COUNT + 1, sizeof(Texture *));
+    int texture_count = 0;
+    uint64_t texels_size = 0;
+    for (int i = 0; i < mats->material_count; i++) {
+        Material *m = &mats->mats[i];
+        memcpy(mat_records[i].name, m->name, sizeof(m->name));
+        for (int p = 0; p < PROP_COUNT; p++) {
+            Vec3OrTexture *vot = material_prop(m, p);
+            mat_records[i].props[p].value = vot->value;
+            mat_records[i].props[p].texture = -1;
+            if (!vot->uses_texture) {
+                continue;
+            }
+            int t = 0;
+            while (t < texture_count && textures[t] != vot->tex) {
+                t++;
+            }
+            if (t == texture_count) {
+                tex_records[t].width = vot->tex->width;
+                tex_records[t].height = vot->tex->height;
+                tex_records[t].format = vot->tex->format;
+                tex_records[t].offset = scene_align(texels_size);
+                textures[texture_count++] = vot->tex;
+                texels_size = tex_records[t].offset + texture_bytes(vot->tex);
+            }
+            mat_records[i].props[p].texture = t;
+        }
+    }
+
+    SceneHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCENE_MAGIC, sizeof(SCENE_MAGIC));
+    header.version = SCENE_VERSION;
+    header.section_count = SECTION_COUNT;
+    header.compressed_attributes = COMPRESS_ATTRIBUTES;
+
+    SceneSection sections[SECTION_COUNT] = {
+        {0, 0, mesh->vertex_count, sizeof(Vec3)},
+        {0, 0, mesh->vertex_count, sizeof(PackedNormal)},
+        {0, 0, mesh->vertex_count, sizeof(PackedUV)},
+        {0, 0, mesh->count, sizeof(Triangle)},
+        {0, 0, mats->material_count, sizeof(SceneMaterialRecord)},
+        {0, 0, texture_count, sizeof(SceneTextureRecord)},
+        {0, texels_size, 0, 1}, // raw bytes, the texture records describe them
+    };
+    const void *data[SECTION_COUNT] = {mesh->positions, mesh->normals, mesh->texcoords, mesh->triangles,
+                                       mat_records, tex_records, NULL};
+    uint64_t offset = sizeof(SceneHeader) + sizeof(sections);
+    for (int i = 0; i < SECTION_COUNT; i++) {
+        if (i != SECTION_TEXELS) {
+            sections[i].size = (uint64_t)sections[i].count * sections[i].elem_size;
+        }
+        sections[i].offset = scene_align(offset);
+        offset = sections[i].offset + sections[i].size;
+    }
+
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(sections, sizeof(sections), 1, file);
+    for (int i = 0; i < SECTION_TEXELS; i++) {
+        write_section(file, &sections[i], data[i]);
+    }
+    for (int i = 0; i < texture_count; i++) {
+        SceneSection texels = {sections[SECTION_TEXELS].offset + tex_records[i].offset,
+                               texture_bytes(textures[i]), 1, 1};
+        write_section(file, &texels, textures[i]->texels);
+    }
+    fclose(file);
+    printf("Wrote %s: %d triangles, %d vertices, %d materials, %d textures\n", filename,
+           mesh->count, mesh->vertex_count, mats->material_count, texture_count);
+    free(mat_records);
+    free(tex_records);
+    free(textures);
+}
+
+/* returns a pointer to the section data or NULL if the section does not fit the file or build */
+const void *scene_section(MappedFile *file, SceneSection *sections, int i, size_t elem_size) {
+    SceneSection *s = &sections[i];
+    int raw = i == SECTION_TEXELS;
+    if (s->elem_size != elem_size || (!raw && s->size != (uint64_t)s->count * s->elem_size) ||
+        s->offset % SCENE_ALIGN != 0 || s->offset > file->size || s->size > file->size - s->offset) {
+        return NULL;
+    }
+    return file->data + s->offset;
+}
+
+/* returns 1 if both files exist and source was modified after target */
+int file_is_newer(const char *source, const char *target) {
+    struct stat s, t;
+    if (stat(source, &s) != 0 || stat(target, &t) != 0) {
+        return 0;
+    }
+    return s.st_mtime > t.st_mtime;
+}
+
+/* maps a binary scene and points the mesh and materials into it. If the page cache is
+enabled the textures are paged in from the file instead. Returns 0 and leaves mesh and
+mats untouched if the file is missing, outdated or does not fit this build */
+int load_binary_scene(const char *filename, Triangles *mesh, Materials *mats) {
+    if (access(filename, R_OK) != 0) {
+        return 0;
+    }
+    MappedFile file = map_file(filename);
+    SceneHeader *header = (SceneHeader *)file.data;
+    SceneSection *sections = (SceneSection *)(file.data + sizeof(SceneHeader));
+    if (file.size < sizeof(SceneHeader) + SECTION_COUNT * sizeof(SceneSection) ||
+        memcmp(header->magic, SCENE_MAGIC, sizeof(SCENE_MAGIC)) != 0 ||
+        header->version != SCENE_VERSION || header->section_count != SECTION_COUNT ||
+        header->compressed_attributes != COMPRESS_ATTRIBUTES) {
+        fprintf(stderr, "Warning: %s was written by a different version or build, ignoring it\n", filename);
+        unmap_file(&file);
+        return 0;
+    }
+    const void *data[SECTION_COUNT];
+    size_t elem_sizes[SECTION_COUNT] = {sizeof(Vec3), sizeof(PackedNormal), sizeof(PackedUV), sizeof(Triangle),
+                                        sizeof(SceneMaterialRecord), sizeof(SceneTextureRecord), 1};
+    for (int i = 0; i < SECTION_COUNT; i++) {
+        data[i] = scene_section(&file, sections, i, elem_sizes[i]);
+        if (!data[i]) {
+            fprintf(stderr, "Warning: %s is damaged, ignoring it\n", filename);
+            unmap_file(&file);
+            return 0;
+        }
+    }
+    // the triangles index into the vertices and materials of the file, a damaged or foreign
+    // file must not send them out of the mapping at render time
+    uint32_t vertex_count = sections[SECTION_POSITIONS].count;
+    uint32_t material_count = sections[SECTION_MATERIALS].count;
+    int valid = sections[SECTION_NORMALS].count == vertex_count && sections[SECTION_TEXCOORDS].count == vertex_count;
+    const Triangle *triangles = data[SECTION_TRIANGLES];
+    for (uint32_t i = 0; valid && i < sections[SECTION_TRIANGLES].count; i++) {
+        const Triangle *t = &triangles[i];
+        for (int k = 0; k < 3; k++) {
+            valid &= t->v[k] >= 0 && (uint32_t)t->v[k] < vertex_count;
+        }
+        valid &= t->material >= 0 && (uint32_t)t->material < material_count;
+    }
+    if (!valid) {
+        fprintf(stderr, "Warning: %s is damaged, ignoring it\n", filename);
+        unmap_file(&file);
+        return 0;
+    }
+
+    mesh->positions = (Vec3 *)data[SECTION_POSITIONS];
+    mesh->normals = (PackedNormal *)data[SECTION_NORMALS];
+    mesh->texcoords = (PackedUV *)data[SECTION_TEXCOORDS];
+    mesh->vertex_count = sections[SECTION_POSITIONS].count;
+    mesh->triangles = (Triangle *)data[SECTION_TRIANGLES];
+    mesh->count = sections[SECTION_TRIANGLES].count;
+    mesh->source = file;
+
+    // the few materials are rebuilt, their texels stay in the mapping and are registered
+    // in the texture cache as entries that are not freed
+    const SceneMaterialRecord *mat_records = data[SECTION_MATERIALS];
+    const SceneTextureRecord *tex_records = data[SECTION_TEXTURES];
+    const char *texels = data[SECTION_TEXELS];
+    mats->material_count = sections[SECTION_MATERIALS].count;
+    mats->mats = calloc(mats->material_count + 1, sizeof(Material));
+    mats->lookup = NULL;
+    mats->default_material = -1;
+    mats->jobs = NULL;
+    mats->job_count = 0;
+    for (int i = 0; i < mats->material_count; i++) {
+        Material *m = &mats->mats[i];
+        memcpy(m->name, mat_records[i].name, sizeof(m->name));
+        m->name[sizeof(m->name) - 1] = '\0';
+        for (int p = 0; p < PROP_COUNT; p++) {
+            const ScenePropRecord *prop = &mat_records[i].props[p];
+            Vec3OrTexture *vot = material_prop(m, p);
+            vot->value = prop->value;
+            if (prop->texture >= 0 && prop->texture < (int)sections[SECTION_TEXTURES].count) {
+                const SceneTextureRecord *tex = &tex_records[prop->texture];
+                Texture mapped = make_texture((void *)(texels + tex->offset), tex->width, tex->height, tex->format);
+                if (tex->format < TEX_R8 || tex->format > TEX_BC4 || tex->width <= 0 || tex->height <= 0 ||
+                    tex->offset + texture_bytes(&mapped) > sections[SECTION_TEXELS].size) {
+                    continue;
+                }
+                char key[1280];
+                snprintf(key, sizeof(key), "%s#%d", filename, prop->texture);
+                int created;
+                CachedTexture *entry = acquire_texture(key, &created);
+                if (created) {
+                    entry->tex = mapped;
+                    entry->owned = 0;
+                    if (page_cache.frame_count > 0) { // read through the page cache instead of the mapping
+                        uint64_t start = sections[SECTION_TEXELS].offset + tex->offset;
+                        entry->tex.paged = page_texels(filename, start, texture_bytes(&mapped));
+                        entry->tex.texels = entry->tex.paged ? NULL : entry->tex.texels;
+                    }
+                }
+                set_prop_texture(vot, &entry->tex);
+            }
+        }
+        compile_material(m);
+    }
+    build_material_lookup(mats);
+    printf("Loaded binary scene %s\n", filename);
+    return 1;
+}
+
+#endif // BINARYSCENE_H
@@ -0,0 +1,146 @@
+#ifndef BLOCKCOMPRESSION_H
+#define BLOCKCOMPRESSION_H
+
+#include <stdint.h>
+#include <string.h>
+#include "linalg.h"
+
+/* BC1 and BC4 blocks: 4x4 texels in 8 bytes. BC1 stores two rgb565 endpoints and a 2 bit
+index per texel into them and two colors in between. BC4 stores two 8 bit endpoints of a
+single channel and a 3 bit index into them and six values in between. The encoders are the
+simple bounding box kind, good enough for textures that are only read by a path tracer */
+
+static inline uint16_t pack_565(Vec3 *c) {
+    int r = (int)(fminf(fmaxf(c->x, 0), 1) * 31 + 0.5f);
+    int g = (int)(fminf(fmaxf(c->y, 0), 1) * 63 + 0.5f);
+    int b = (int)(fminf(fmaxf(c->z, 0), 1) * 31 + 0.5f);
+    return (uint16_t)((r << 11) | (g << 5) | b);
+}
+
+static inline Vec3 unpack_565(uint16_t c) {
+    return (Vec3){((c >> 11) & 31) * (1.0f / 31), ((c >> 5) & 63) * (1.0f / 63), (c & 31) * (1.0f / 31)};
+}
+
+static inline void bc1_palette(uint16_t c0, uint16_t c1, Vec3 *palette) {
+    palette[0] = unpack_565(c0);
+    palette[1] = unpack_565(c1);
+    if (c0 > c1) {
+        vec3_lerp(&palette[0], &palette[1], 1.0f / 3, &palette[2]);
+        vec3_lerp(&palette[0], &palette[1], 2.0f / 3, &palette[3]);
+    } else { // three color mode, the fourth color is black
+        vec3_lerp(&palette[0], &palette[1], 0.5f, &palette[2]);
+        palette[3] = (Vec3){0, 0, 0};
+    }
+}
+
+void bc1_encode_block(Vec3 *texels, uint8_t *out) {
+    Vec3 lo = texels[0], hi = texels[0], mean = {0, 0, 0};
+    for (int i = 0; i < 16; i++) {
+        vec3_min(&lo, &texels[i], &lo);
+        vec3_max(&hi, &texels[i], &hi);
+        vec3_add(&mean, &texels[i], &mean);
+    }
+    vec3_scale(&mean, 1.0f / 16, &mean);
+    // pick the diagonal of the box the colors vary along, green and blue against red
+    float cov_g = 0, cov_b = 0;
+    for (int i = 0; i < 16; i++) {
+        cov_g += (texels[i].x - mean.x) * (texels[i].y - mean.y);
+        cov_b += (texels[i].x - mean.x) * (texels[i].z - mean.z);
+    }
+    if (cov_g < 0) {
+        float t = lo.y; lo.y = hi.y; hi.y = t;
+    }
+    if (cov_b < 0) {
+        float t = lo.z; lo.z = hi.z; hi.z = t;
+    }
+    uint16_t c0 = pack_565(&hi);
+    uint16_t c1 = pack_565(&lo);
+    if (c0 < c1) {
+        uint16_t t = c0; c0 = c1; c1 = t;
+    }
+    uint32_t indices = 0;
+    if (c0 != c1) {
+        Vec3 palette[4];
+        bc1_palette(c0, c1, palette);
+        for (int i = 0; i < 16; i++) {
+            int best = 0;
+            float best_dist = INFINITY;
+            for (int k = 0; k < 4; k++) {
+                Vec3 d;
+                vec3_subtract(&texels[i], &palette[k], &d);
+                float dist = vec3_dot(&d, &d);
+                if (dist < best_dist) {
+                    best_dist = dist;
+                    best = k;
+                }
+            }
+            indices |= (uint32_t)best << (2 * i);
+        }
+    }
+    uint8_t block[8] = {c0 & 255, c0 >> 8, c1 & 255, c1 >> 8,
+                        indices & 255, (indices >> 8) & 255, (indices >> 16) & 255, indices >> 24};
+    memcpy(out, block, 8);
+}
+
+static inline Vec3 bc1_decode_texel(const uint8_t *block, int t) {
+    uint16_t c0 = block[0] | (block[1] << 8);
+    uint16_t c1 = block[2] | (block[3] << 8);
+    int index = (block[4 + (t >> 2)] >> (2 * (t & 3))) & 3;
+    Vec3 palette[4];
+    bc1_palette(c0, c1, palette);
+    return palette[index];
+}
+
+static inline float bc4_value(int a0, int a1, int index) {
+    if (index < 2) {
+        return (index == 0 ? a0 : a1) * (1.0f / 255);
+    }
+    if (a0 > a1) {
+        return ((8 - index) * a0 + (index - 1) * a1) * (1.0f / (7 * 255));
+    }
+    if (index < 6) { // six value mode, with exact 0 and 1 as the last two
+        return ((6 - index) * a0 + (index - 1) * a1) * (1.0f / (5 * 255));
+    }
+    return index == 6 ? 0 : 1;
+}
+
+/* encodes the .x of the texels */
+void bc4_encode_block(Vec3 *texels, uint8_t *out) {
+    float lo = texels[0].x, hi = texels[0].x;
+    for (int i = 1; i < 16; i++) {
+        lo = fminf(lo, texels[i].x);
+        hi = fmaxf(hi, texels[i].x);
+    }
+    int a0 = (int)(fminf(fmaxf(hi, 0), 1) * 255 + 0.5f);
+    int a1 = (int)(fminf(fmaxf(lo, 0), 1) * 255 + 0.5f);
+    uint64_t indices = 0;
+    if (a0 != a1) {
+        for (int i = 0; i < 16; i++) {
+            int best = 0;
+            float best_dist = INFINITY;
+            for (int k = 0; k < 8; k++) {
+                float dist = fabsf(texels[i].x - bc4_value(a0, a1, k));
+                if (dist < best_dist) {
+                    best_dist = dist;
+                    best = k;
+                }
+            }
+            indices |= (uint64_t)best << (3 * i);
+        }
+    }
+    out[0] = (uint8_t)a0;
+    out[1] = (uint8_t)a1;
+    for (int i = 0; i < 6; i++) {
+        out[2 + i] = (uint8_t)(indices >> (8 * i));
+    }
+}
+
+static inline float bc4_decode_texel(const uint8_t *block, int t) {
+    int bit = 3 * t;
+    int byte = 2 + (bit >> 3);
+    int pair = block[byte] | (byte < 7 ? block[byte + 1] << 8 : 0); // an index can span two bytes
+    int index = (pair >> (bit & 7)) & 7;
+    return bc4_value(block[0], block[1], index);
+}
+
+#endif // BLOCKCOMPRESSION_H
@@ -0,0 +1,37 @@
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+/* Hot kernels are compiled once per instruction set level and the dynamic loader picks
+the best clone for the cpu we run on (gcc/clang function multiversioning). The small
+Vec3 helpers get inlined into every clone, so they are vectorized for each level too.
+Build with -DNO_CPU_DISPATCH to get a single generic version. */
+#if !defined(NO_CPU_DISPATCH) && defined(__x86_64__) && defined(__linux__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define CPU_DISPATCH 1
+#endif
+#endif
+
+#ifdef CPU_DISPATCH
+#define HOT_KERNEL __attribute__((target_clones("arch=x86-64-v4", "arch=x86-64-v3", "arch=x86-64-v2", "default")))
+#else
+#define HOT_KERNEL
+#endif
+
+/* returns the name of the clone the loader selects, same priority as HOT_KERNEL */
+const char *cpu_dispatch_name() {
+#ifdef CPU_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("x86-64-v4")) {
+        return "x86-64-v4 (AVX-512)";
+    }
+    if (__builtin_cpu_supports("x86-64-v3")) {
+        return "x86-64-v3 (AVX2, FMA)";
+    }
+    if (__builtin_cpu_supports("x86-64-v2")) {
+        return "x86-64-v2 (SSE4.2)";
+    }
+#endif
+    return "generic";
+}
+
+#endif // DISPATCH_H
@@ -1,8 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
 #include <omp.h> // Include the OpenMP header
 #include "toneMapping.h"
+#include "adaptive.h"
+#include "binaryScene.h"
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
@@ -13,53 +14,68 @@ const int HEIGHT = 800;
 const float DOF = 0.018;
 const float FSTOP = 4.7;
 const int SAMPLES = 30000;
-const int BOUNCES = 3;
+const int BOUNCES = 8; // upper limit, russian roulette ends dark paths earlier, see trace
 const int gridcells = 150; // 150 for motorbike please
 const char *FILENAME = "output.png";
+const char *SAMPLEMAP_FILENAME = "samples.png"; // samples taken per pixel, white is the most
 const char *OBJFILE = "scene/baseScene.obj";
 const char *MATFILENAME = "scene/baseScene.mtl";
+const char *SCENEFILE = "scene/baseScene.ttscene"; // written by bin/scene2bin, used instead of obj/mtl if it exists
 const char *TEXTURESFOLDER = "scene/textures";
+const int TEXTURE_CACHE_MB = 0; // > 0 pages the textures of the binary scene or the disk cache through a cache of this size
+const char *TEXTURE_DISK_CACHE = "scene/texcache"; // decoded textures are kept here and mapped on later runs, "" disables it
+const int RESAMPLE_LIGHTS = 1; // 1 estimates the direct light of camera hits with reservoirs, see reservoirs.h
+const uint64_t SEED = 1; // the same seed renders the same image
+const int SAMPLER = SAMPLER_SOBOL; // SAMPLER_SOBOL, SAMPLER_BLUE_NOISE or SAMPLER_RANDOM, see sampler.h
+const float ADAPTIVE_ERROR = 0.02f; // relative standard error at which a tile stops sampling, 0 samples every pixel SAMPLES times, see adaptive.h
 
-void storeImage(unsigned char *image, float *image_buff, int curr_samples) {
-    float max_v = 0;
-    for (int i = 0; i < HEIGHT*WIDTH*3; i++) {
-        if (image_buff[i] > max_v){
-            max_v = image_buff[i];
-        }
+void storeImage(unsigned char *image, float *image_buff, const int *samples) {
+    tonemap_image(image_buff, image, WIDTH*HEIGHT, samples);
+    if (!stbi_write_png(FILENAME, WIDTH, HEIGHT, 3, image, WIDTH * 3)) {
+        printf("Error: Unable to write image to file %s.\n", FILENAME);
     }
-    for (int y = 0; y < HEIGHT; y++) {
-        for (int x = 0; x < WIDTH; x++) {
-            Vec3 c;
-            c.x = image_buff[(y * WIDTH + x) * 3]/curr_samples;
-            c.y = image_buff[(y * WIDTH + x) * 3+1]/curr_samples;
-            c.z = image_buff[(y * WIDTH + x) * 3+2]/curr_samples;
-            c = reinhard_extended_luminance(c, max_v);
-            if (c.x > 1){ c.x = 1; }
-            if (c.y > 1){ c.y = 1; }
-            if (c.z > 1){ c.z = 1; }
+}
 
-            image[(y * WIDTH + x) * 3] = (unsigned char)(c.x*255);
-            image[(y * WIDTH + x) * 3 + 1] = (unsigned char)(c.y*255);
-            image[(y * WIDTH + x) * 3 + 2] = (unsigned char)(c.z*255);
+/* writes the number of samples of every pixel as a grayscale image, scaled to the most sampled pixel */
+void storeSampleMap(unsigned char *image, const int *samples) {
+    int max_samples = 1;
+    for (int i = 0; i < WIDTH * HEIGHT; i++) {
+        if (samples[i] > max_samples) {
+            max_samples = samples[i];
         }
     }
-    if (!stbi_write_png(FILENAME, WIDTH, HEIGHT, 3, image, WIDTH * 3)) {
-        printf("Error: Unable to write image to file %s.\n", FILENAME);
+    for (int i = 0; i < WIDTH * HEIGHT; i++) {
+        image[i] = (unsigned char)(255.0f * samples[i] / max_samples);
+    }
+    if (!stbi_write_png(SAMPLEMAP_FILENAME, WIDTH, HEIGHT, 1, image, WIDTH)) {
+        printf("Error: Unable to write image to file %s.\n", SAMPLEMAP_FILENAME);
     }
 }
 
 void render_scene() {
+    printf("Using %s kernels\n", cpu_dispatch_name());
     // Measure total execution time
     double preprocess_start = omp_get_wtime();
-    // Load mesh
-    Materials mats = load_materials(MATFILENAME);
+    // Load mesh, from the binary scene if there is an up to date one
+    Materials mats;
+    Triangles triangles;
+    texture_disk_cache = TEXTURE_DISK_CACHE;
+    if (TEXTURE_CACHE_MB > 0) {
+        init_page_cache((size_t)TEXTURE_CACHE_MB << 20);
+    }
+    int outdated = file_is_newer(OBJFILE, SCENEFILE) || file_is_newer(MATFILENAME, SCENEFILE);
+    if (outdated) {
+        printf("%s is older than the obj/mtl files, run make convert to update it\n", SCENEFILE);
+    }
+    if (outdated || !load_binary_scene(SCENEFILE, &triangles, &mats)) {
+        load_obj_scene(OBJFILE, MATFILENAME, &triangles, &mats);
+    }
     for (int i = 0; i < mats.material_count; i++)
     {
         Material m = mats.mats[i];
         print_material(&m);
     }
-    
-    Triangles triangles = read_obj_file(OBJFILE, &mats);
+
     Vec3 cam_pos = {0, 0, 5};
     Vec3 cam_rot = {0, 0, 0};
     Camera cam = {cam_pos, cam_rot, WIDTH, HEIGHT, FOCAL_LENGTH};
@@ -82,33 +98,131 @@ void render_scene() {
         printf("Error: Unable to allocate memory for image.\n");
         return;
     }
+    // first diffuse hit and candidate reservoir of every pixel in the current pass
+    PrimaryHit *hits = NULL;
+    Reservoir *candidates = NULL;
+    if (RESAMPLE_LIGHTS && mainScene.lights.count > 0) {
+        hits = malloc(WIDTH * HEIGHT * sizeof(PrimaryHit));
+        candidates = malloc(WIDTH * HEIGHT * sizeof(Reservoir));
+        if (!hits || !candidates) {
+            printf("Error: Unable to allocate memory for the light reservoirs.\n");
+            return;
+        }
+    }
+    float pixel_spread = camera_pixel_spread(&cam);
+    PathStats path_stats = {0, 0, 0};
+    // radiance of every pixel in the current pass, then added to image_buff and its statistics
+    Vec3 *pass_buff = malloc(WIDTH * HEIGHT * sizeof(Vec3));
+    if (!pass_buff) {
+        printf("Error: Unable to allocate memory for image.\n");
+        return;
+    }
+    AdaptiveState adaptive;
+    init_adaptive(&adaptive, WIDTH, HEIGHT);
+    int passes = 0;
     // Start parallel region
     #pragma omp parallel
     {
         Ray cam_ray;
         cam_ray.origin = cam.position;
-        for (int sampl = 0; sampl < SAMPLES; sampl++)
+        PathStats thread_stats = {0, 0, 0};
+        for (int sampl = 0; sampl < SAMPLES && adaptive.active_count > 0; sampl++)
         {
-            #pragma omp for collapse(2) schedule(dynamic, 2)
-            for (int y = 0; y < HEIGHT; y++) {
-                for (int x = 0; x < WIDTH; x++) {
-                    screen2CameraDir(&cam, DOF, FSTOP, x, y, &cam_ray);
-                    Vec3 pix = trace(&mainScene, &cam_ray, BOUNCES);
-                    int this_y = HEIGHT - y - 1;
-                    image_buff[(this_y * WIDTH + x) * 3] += pix.x;            // Red
-                    image_buff[(this_y * WIDTH + x) * 3 + 1] += pix.y;        // Green
-                    image_buff[(this_y * WIDTH + x) * 3 + 2] += pix.z;        // Blue
+            #pragma omp for schedule(dynamic, 1)
+            for (int t = 0; t < adaptive.active_count; t++) {
+                int x0, y0, x1, y1;
+                tile_bounds(&adaptive, adaptive.active[t], &x0, &y0, &x1, &y1);
+                for (int y = y0; y < y1; y++) {
+                    for (int x = x0; x < x1; x++) {
+                        Sampler sampler = make_sampler(SAMPLER, SEED, x, y, sampl);
+                        screen2CameraDir(&cam, DOF, FSTOP, x, y, &cam_ray, &sampler);
+                        pass_buff[y * WIDTH + x] = trace(&mainScene, &cam_ray, BOUNCES, pixel_spread,
+                                                         hits ? &hits[y * WIDTH + x] : NULL, &thread_stats, &sampler);
+                    }
+                }
+            }
+            if (hits) { // direct light of the recorded hits, once all candidates of this pass exist
+                #pragma omp for schedule(dynamic, 1)
+                for (int t = 0; t < adaptive.active_count; t++) {
+                    int x0, y0, x1, y1;
+                    tile_bounds(&adaptive, adaptive.active[t], &x0, &y0, &x1, &y1);
+                    for (int y = y0; y < y1; y++) {
+                        for (int x = x0; x < x1; x++) {
+                            int i = y * WIDTH + x;
+                            Sampler sampler = make_sampler(SAMPLER, SEED, x, y, sampl);
+                            resample_candidates(&mainScene, &hits[i], &candidates[i], &sampler);
+                        }
+                    }
+                }
+                #pragma omp for schedule(dynamic, 1)
+                for (int t = 0; t < adaptive.active_count; t++) {
+                    int x0, y0, x1, y1;
+                    tile_bounds(&adaptive, adaptive.active[t], &x0, &y0, &x1, &y1);
+                    for (int y = y0; y < y1; y++) {
+                        for (int x = x0; x < x1; x++) {
+                            Sampler sampler = make_sampler(SAMPLER, SEED, x, y, sampl);
+                            Vec3 pix = resample_neighbors(&mainScene, hits, candidates, WIDTH, HEIGHT, x, y, &sampler);
+                            vec3_add(&pass_buff[y * WIDTH + x], &pix, &pass_buff[y * WIDTH + x]);
+                        }
+                    }
+                }
+            }
+            #pragma omp for schedule(dynamic, 1)
+            for (int t = 0; t < adaptive.active_count; t++) {
+                int x0, y0, x1, y1;
+                tile_bounds(&adaptive, adaptive.active[t], &x0, &y0, &x1, &y1);
+                for (int y = y0; y < y1; y++) {
+                    for (int x = x0; x < x1; x++) {
+                        Vec3 pix = pass_buff[y * WIDTH + x];
+                        int pixel = image_pixel(&adaptive, x, y);
+                        image_buff[pixel * 3] += pix.x;            // Red
+                        image_buff[pixel * 3 + 1] += pix.y;        // Green
+                        image_buff[pixel * 3 + 2] += pix.z;        // Blue
+                        add_pixel_sample(&adaptive, pixel, pix);
+                    }
+                }
+                if (ADAPTIVE_ERROR > 0 && tile_converged(&adaptive, adaptive.active[t], ADAPTIVE_ERROR)) {
+                    adaptive.converged[t] = 1;
+                    for (int y = y0; hits && y < y1; y++) { // its reservoirs go stale, keep them from the neighbours
+                        for (int x = x0; x < x1; x++) {
+                            hits[y * WIDTH + x].valid = 0;
+                        }
+                    }
                 }
             }
             #pragma omp single
             {
-                storeImage(image, image_buff, sampl+1);
-                printf("sample %d/%d\n", sampl+1, SAMPLES);
+                remove_converged_tiles(&adaptive);
+                passes = sampl + 1;
+                storeImage(image, image_buff, adaptive.samples);
+                printf("sample %d/%d, %d of %d tiles left\n", sampl+1, SAMPLES, adaptive.active_count,
+                       adaptive.tiles_x * adaptive.tiles_y);
             }
         }
+        #pragma omp critical
+        {
+            path_stats.paths += thread_stats.paths;
+            path_stats.segments += thread_stats.segments;
+            path_stats.roulette += thread_stats.roulette;
+        }
     } // End parallel region
+    if (adaptive.active_count == 0) {
+        printf("All pixels converged after %d samples\n", passes);
+    }
+    printf("Average samples per pixel: %.1f\n", (double)path_stats.paths / (WIDTH * HEIGHT));
+    storeSampleMap(image, adaptive.samples);
+    if (path_stats.paths > 0) {
+        printf("Average path length: %.2f of %d bounces, %.1f%% of the paths ended by russian roulette\n",
+               (double)path_stats.segments / path_stats.paths, BOUNCES,
+               100.0 * path_stats.roulette / path_stats.paths);
+    }
 
     freeScene(&mainScene);
+    free(hits);
+    free(candidates);
+    free(pass_buff);
+    free_adaptive(&adaptive);
+    free_page_cache();
     free(image);
     free(image_buff);
 
@@ -119,7 +233,6 @@ void render_scene() {
 }
 
 int main() {
-    srand(time(NULL));
     render_scene();
     printf("Image created successfully: %s\n", FILENAME);
     return 0;
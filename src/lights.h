@@ -0,0 +1,344 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "mesh.h"
+#include "materials.h"
+
+/* triangles of constant emissive materials, for sampling them directly (next event
+estimation). They are the leaves of a binary tree whose nodes bound the position,
+normals (a cone around an axis) and power (emission times area) of the lights below.
+Sampling walks down from the root and picks each child with the probability of its
+estimated contribution at the shading point, so thousands of small lights cost a few
+importance estimates instead of one shadow ray each. A point is then chosen uniformly
+on the light. Textured emitters are not in the tree, they are only found by bounces */
+typedef struct {
+    Vec3 min, max;    // bounds of the triangles below
+    Vec3 axis;        // of the cone bounding their normals
+    float cos_theta;  // of the half angle of the cone, -1 if it is the whole sphere
+    float power;
+    int child;        // index of the first child, the second follows it. -1 - light for leaves
+} LightNode;
+
+/* light of a triangle and the path to its leaf, bit i is 1 if the walk goes to the
+second child at depth i */
+typedef struct {
+    int triangle;
+    int depth;
+    uint64_t trail;
+} LightRef;
+
+typedef struct {
+    int *triangles;   // of the lights, in leaf order
+    int count;
+    LightNode *nodes; // root first
+    int node_count;
+    LightRef *refs;   // sorted by triangle, see find_light
+} Lights;
+
+static inline float triangle_area(Triangles *mesh, Triangle *t, Vec3 *geometric_normal) {
+    Vec3 e1, e2, cross;
+    vec3_subtract(&mesh->positions[t->v[1]], &mesh->positions[t->v[0]], &e1);
+    vec3_subtract(&mesh->positions[t->v[2]], &mesh->positions[t->v[0]], &e2);
+    vec3_cross(&e1, &e2, &cross);
+    float length = vec3_magnitude(&cross);
+    if (geometric_normal) {
+        vec3_scale(&cross, length > 0 ? 1 / length : 0, geometric_normal);
+    }
+    return 0.5f * length;
+}
+
+void free_lights(Lights *lights) {
+    free(lights->triangles);
+    free(lights->nodes);
+    free(lights->refs);
+    memset(lights, 0, sizeof(Lights));
+}
+
+/* smallest cone containing the cones a and b. Lights shine to both sides, so a cone
+stands for its mirror image too and b is flipped if that makes the union tighter */
+void cone_union(Vec3 *axis_a, float cos_a, Vec3 *axis_b, float cos_b, Vec3 *axis, float *cos_theta) {
+    Vec3 b = *axis_b;
+    if (vec3_dot(axis_a, &b) < 0) {
+        vec3_invert(&b, &b);
+    }
+    float theta_a = acosf(fminf(fmaxf(cos_a, -1), 1));
+    float theta_b = acosf(fminf(fmaxf(cos_b, -1), 1));
+    float theta_d = acosf(fminf(fmaxf(vec3_dot(axis_a, &b), -1), 1));
+    if (fminf(theta_d + theta_b, M_PI) <= theta_a) {
+        *axis = *axis_a;
+        *cos_theta = cos_a;
+        return;
+    }
+    if (fminf(theta_d + theta_a, M_PI) <= theta_b) {
+        *axis = b;
+        *cos_theta = cos_b;
+        return;
+    }
+    float theta_o = 0.5f * (theta_a + theta_d + theta_b);
+    Vec3 w;
+    vec3_cross(axis_a, &b, &w);
+    float w_length = vec3_magnitude(&w);
+    if (theta_o >= M_PI || w_length < 1e-6f) {
+        *axis = *axis_a;
+        *cos_theta = -1;
+        return;
+    }
+    // rotate axis_a towards b by theta_o - theta_a (Rodrigues)
+    float theta_r = theta_o - theta_a;
+    vec3_scale(&w, 1 / w_length, &w);
+    Vec3 w_cross_a, rotated;
+    vec3_cross(&w, axis_a, &w_cross_a);
+    vec3_scale(axis_a, cosf(theta_r), &rotated);
+    vec3_scale(&w_cross_a, sinf(theta_r), &w_cross_a);
+    vec3_add(&rotated, &w_cross_a, axis);
+    *cos_theta = cosf(theta_o);
+}
+
+/* builds the subtree of nodes[node] over the lights in [start, end) and returns the
+index after the last node it used. Deep subtrees are split in half so every trail fits
+in 64 bits */
+int build_light_node(Lights *lights, LightNode *leaves, int node, int depth, int start, int end, int next) {
+    LightNode *n = &lights->nodes[node];
+    if (end - start == 1) {
+        *n = leaves[start];
+        n->child = -1 - start;
+        return next;
+    }
+    Vec3 lo = {INFINITY, INFINITY, INFINITY}, hi = {-INFINITY, -INFINITY, -INFINITY};
+    for (int i = start; i < end; i++) {
+        Vec3 centroid;
+        vec3_add(&leaves[i].min, &leaves[i].max, &centroid);
+        vec3_min(&lo, &centroid, &lo);
+        vec3_max(&hi, &centroid, &hi);
+    }
+    // split at the middle of the longest extent of the centroids, or in half if they all fall on one side
+    Vec3 extent;
+    vec3_subtract(&hi, &lo, &extent);
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    float split = 0.5f * (((float *)&lo)[axis] + ((float *)&hi)[axis]);
+    int mid = start;
+    for (int i = start; i < end; i++) {
+        Vec3 centroid;
+        vec3_add(&leaves[i].min, &leaves[i].max, &centroid);
+        if (((float *)&centroid)[axis] < split) {
+            LightNode t = leaves[i]; leaves[i] = leaves[mid]; leaves[mid] = t;
+            int tri = lights->triangles[i]; lights->triangles[i] = lights->triangles[mid]; lights->triangles[mid] = tri;
+            mid++;
+        }
+    }
+    if (mid == start || mid == end || depth >= 40) {
+        mid = (start + end) / 2;
+    }
+    int child = next;
+    next = build_light_node(lights, leaves, child, depth + 1, start, mid, next + 2);
+    next = build_light_node(lights, leaves, child + 1, depth + 1, mid, end, next);
+    LightNode *a = &lights->nodes[child], *b = &lights->nodes[child + 1];
+    n = &lights->nodes[node];
+    vec3_min(&a->min, &b->min, &n->min);
+    vec3_max(&a->max, &b->max, &n->max);
+    cone_union(&a->axis, a->cos_theta, &b->axis, b->cos_theta, &n->axis, &n->cos_theta);
+    n->power = a->power + b->power;
+    n->child = child;
+    return next;
+}
+
+/* records the path to every leaf below node */
+void trace_light_trails(Lights *lights, int node, int depth, uint64_t trail) {
+    LightNode *n = &lights->nodes[node];
+    if (n->child < 0) {
+        int light = -1 - n->child;
+        lights->refs[light] = (LightRef){lights->triangles[light], depth, trail};
+        return;
+    }
+    trace_light_trails(lights, n->child, depth + 1, trail);
+    trace_light_trails(lights, n->child + 1, depth + 1, trail | (uint64_t)1 << depth);
+}
+
+/* by triangle, for find_light */
+static int compare_light_refs(const void *a, const void *b) {
+    int ta = ((const LightRef *)a)->triangle, tb = ((const LightRef *)b)->triangle;
+    return (ta > tb) - (ta < tb);
+}
+
+Lights build_lights(Triangles *mesh, Materials *mats) {
+    Lights lights;
+    memset(&lights, 0, sizeof(lights));
+    int count = 0;
+    for (int i = 0; i < mesh->count; i++) {
+        Material *m = &mats->mats[mesh->triangles[i].material];
+        count += (m->flags & MAT_EMISSIVE) && triangle_area(mesh, &mesh->triangles[i], NULL) > 0;
+    }
+    if (count == 0) {
+        return lights;
+    }
+    lights.triangles = malloc(count * sizeof(int));
+    lights.nodes = malloc((2 * count - 1) * sizeof(LightNode));
+    lights.refs = malloc(count * sizeof(LightRef));
+    LightNode *leaves = malloc(count * sizeof(LightNode));
+    if (!lights.triangles || !lights.nodes || !lights.refs || !leaves) {
+        fprintf(stderr, "Error: Memory allocation failed for the light tree\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < mesh->count; i++) {
+        Triangle *t = &mesh->triangles[i];
+        Material *m = &mats->mats[t->material];
+        Vec3 normal;
+        float area = triangle_area(mesh, t, &normal);
+        if (!(m->flags & MAT_EMISSIVE) || area <= 0) {
+            continue;
+        }
+        LightNode *leaf = &leaves[lights.count];
+        leaf->min = leaf->max = mesh->positions[t->v[0]];
+        for (int k = 1; k < 3; k++) {
+            vec3_min(&leaf->min, &mesh->positions[t->v[k]], &leaf->min);
+            vec3_max(&leaf->max, &mesh->positions[t->v[k]], &leaf->max);
+        }
+        leaf->axis = normal;
+        leaf->cos_theta = 1;
+        leaf->power = m->emissive.value.x * area;
+        lights.triangles[lights.count++] = i;
+    }
+    lights.node_count = build_light_node(&lights, leaves, 0, 0, 0, lights.count, 1);
+    free(leaves);
+    trace_light_trails(&lights, 0, 0, 0);
+    // the refs are in leaf order, which follows the splits and not the triangles
+    qsort(lights.refs, lights.count, sizeof(LightRef), compare_light_refs);
+    printf("Sampling %d emissive triangles through a light tree of %d nodes\n", lights.count, lights.node_count);
+    return lights;
+}
+
+/* returns the LightRef of a triangle or NULL if it is not in the tree */
+LightRef *find_light(Lights *lights, int triangle) {
+    int lo = 0, hi = lights->count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (lights->refs[mid].triangle == triangle) {
+            return &lights->refs[mid];
+        }
+        if (lights->refs[mid].triangle < triangle) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return NULL;
+}
+
+/* cos(max(0, acos(cos_a) - acos(cos_b))), the angle a reduced by b */
+static inline float cos_sub_clamped(float cos_a, float cos_b) {
+    if (cos_a >= cos_b) {
+        return 1;
+    }
+    float sin_a = sqrtf(fmaxf(0, 1 - cos_a * cos_a));
+    float sin_b = sqrtf(fmaxf(0, 1 - cos_b * cos_b));
+    return cos_a * cos_b + sin_a * sin_b;
+}
+
+/* estimated light of the node arriving at point on the side normal faces: its power
+over the squared distance, times the most favorable cosines its bounds allow at the
+light and at the surface */
+static inline float light_node_importance(LightNode *node, Vec3 *point, Vec3 *normal) {
+    Vec3 center, diagonal, to_point;
+    vec3_add(&node->min, &node->max, &center);
+    vec3_scale(&center, 0.5f, &center);
+    vec3_subtract(&node->max, &node->min, &diagonal);
+    vec3_subtract(point, &center, &to_point);
+    float dist2 = vec3_dot(&to_point, &to_point);
+    float radius2 = 0.25f * vec3_dot(&diagonal, &diagonal);
+    if (dist2 <= radius2) { // inside the bounds, every direction is possible
+        return node->power / fmaxf(radius2, 1e-8f);
+    }
+    vec3_scale(&to_point, 1 / sqrtf(dist2), &to_point);
+    float cos_bounds = sqrtf(1 - radius2 / dist2); // half angle the bounds cover seen from point
+    // angle between the emitting side of the lights and the point
+    float cos_light = cos_sub_clamped(fabsf(vec3_dot(&node->axis, &to_point)), node->cos_theta);
+    cos_light = cos_sub_clamped(cos_light, cos_bounds);
+    if (cos_light <= 0) {
+        return 0;
+    }
+    float cos_surface = cos_sub_clamped(-vec3_dot(normal, &to_point), cos_bounds);
+    if (cos_surface <= 0) {
+        return 0;
+    }
+    return node->power * cos_light * cos_surface / fmaxf(dist2, radius2);
+}
+
+/* picks a light for point and a point on it. Returns the triangle index or -1 if no
+light can reach the point, the point, the geometric normal of the triangle and the
+probability of having picked it. Takes two dimensions of the sampler, the number that
+picks the child at every level is rescaled and used again one level down */
+int sample_light(Lights *lights, Triangles *mesh, Vec3 *point, Vec3 *normal, Vec3 *light_point,
+                 Vec3 *light_normal, float *probability, Sampler *sampler) {
+    int node = 0;
+    float p = 1;
+    float u = sample_1d(sampler);
+    Vec2 point_u = sample_2d(sampler);
+    while (lights->nodes[node].child >= 0) {
+        int child = lights->nodes[node].child;
+        float a = light_node_importance(&lights->nodes[child], point, normal);
+        float b = light_node_importance(&lights->nodes[child + 1], point, normal);
+        if (a + b <= 0) {
+            return -1;
+        }
+        float p_a = a / (a + b);
+        if (u < p_a) {
+            node = child;
+            p *= p_a;
+            u /= p_a;
+        } else {
+            node = child + 1;
+            p *= 1 - p_a;
+            u = (u - p_a) / (1 - p_a);
+        }
+        u = fminf(u, 0x1.fffffep-1f);
+    }
+    int light = -1 - lights->nodes[node].child;
+    *probability = p;
+    int tria_ind = lights->triangles[light];
+    Triangle *t = &mesh->triangles[tria_ind];
+    triangle_area(mesh, t, light_normal);
+    float s = sqrtf(point_u.x); // uniform barycentrics
+    float v = point_u.y * s;
+    Vec3 e1, e2;
+    vec3_subtract(&mesh->positions[t->v[1]], &mesh->positions[t->v[0]], &e1);
+    vec3_subtract(&mesh->positions[t->v[2]], &mesh->positions[t->v[0]], &e2);
+    vec3_scale(&e1, s - v, &e1);
+    vec3_scale(&e2, v, &e2);
+    vec3_add(&mesh->positions[t->v[0]], &e1, light_point);
+    vec3_add(light_point, &e2, light_point);
+    return tria_ind;
+}
+
+/* probability of sample_light picking the light ref at point */
+float light_probability(Lights *lights, LightRef *ref, Vec3 *point, Vec3 *normal) {
+    int node = 0;
+    float p = 1;
+    for (int depth = 0; depth < ref->depth; depth++) {
+        int child = lights->nodes[node].child;
+        float a = light_node_importance(&lights->nodes[child], point, normal);
+        float b = light_node_importance(&lights->nodes[child + 1], point, normal);
+        if (a + b <= 0) {
+            return 0;
+        }
+        int second = (ref->trail >> depth) & 1;
+        p *= (second ? b : a) / (a + b);
+        node = child + second;
+    }
+    return p;
+}
+
+/* pdf in solid angle of reaching a point of a light with the given pick probability
+and area from distance dist, cos_light is between the direction and the light normal */
+static inline float light_pdf(float probability, float area, float dist, float cos_light) {
+    return probability / area * dist * dist / fmaxf(fabsf(cos_light), 1e-6f);
+}
+
+/* multiple importance sampling weight of a sample with pdf a against one with pdf b */
+static inline float power_heuristic(float a, float b) {
+    return a * a / (a * a + b * b);
+}
+
+#endif // LIGHTS_H
@@ -1,6 +1,8 @@
 #ifndef LINALG_H
 #define LINALG_H
 #include <math.h>
+#include <stdint.h>
+#include <string.h>
 
 typedef struct {
     float x, y, z;
@@ -168,9 +170,40 @@ void vec3_lerp(Vec3 *v1, Vec3 *v2, float alpha, Vec3 *out){
     vec3_add(&first_scale, &second_scale, out);
 }
 
-float randFloat(){
-    float x = (float)rand()/(float)(RAND_MAX);
-    return x;
+/* PCG32 random number generator (O'Neill 2014). Every thread or pixel owns one, so the
+threads do not share the state of rand() and a seed gives the same image every run */
+typedef struct {
+    uint64_t state;
+    uint64_t inc; // odd, selects the sequence
+} Rng;
+
+/* splitmix64 finalizer, spreads keys that differ in a few bits over all bits */
+static inline uint64_t hash64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+static inline uint32_t rng_next(Rng *rng) {
+    uint64_t old = rng->state;
+    rng->state = old * 6364136223846793005ull + rng->inc;
+    uint32_t xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+    uint32_t rot = (uint32_t)(old >> 59);
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+/* generator for one sequence of a seed, e.g. one per pixel and pass */
+static inline Rng rng_seed(uint64_t seed, uint64_t sequence) {
+    Rng rng = {hash64(seed ^ hash64(sequence)), (hash64(sequence + seed) << 1) | 1};
+    rng_next(&rng);
+    return rng;
+}
+
+/* uniform in [0, 1) */
+static inline float randFloat(Rng *rng){
+    return (rng_next(rng) >> 8) * (1.0f / 16777216.0f);
 }
 
 void vec3_normalize(Vec3 *v, Vec3 *result) {
@@ -185,55 +218,101 @@ void vec3_normalize(Vec3 *v, Vec3 *result) {
     }
 }
 
-/* return random point on unit sphere. Randomized algorithm. TODO: try out faster functions */
-Vec3 rand_unit(){
-    Vec3 curr;
-    for (size_t i = 0; i < 100; i++)
-    {
-        curr.x = (randFloat()-0.5)*2;
-        curr.y = (randFloat()-0.5)*2;
-        curr.z = (randFloat()-0.5)*2;
-        float mag_squared = vec3_dot(&curr, &curr);
-        if (mag_squared <= 1 && mag_squared != 0){
-            vec3_scale(&curr, 1/sqrt(mag_squared), &curr);
-            return curr;
-        }
+/* maps a point of the unit square to the unit circle, keeping neighbouring points
+together (concentric mapping of Shirley and Chiu) */
+Vec3 sample_disk(Vec2 *u){
+    float a = 2 * u->x - 1;
+    float b = 2 * u->y - 1;
+    Vec3 curr = {0, 0, 0};
+    if (a == 0 && b == 0) {
+        return curr;
     }
-    Vec3 ret_vec = {1, 0, 0}; 
-    return ret_vec;
-}
-
-/* return random point in a circle. Randomized algorithm. */
-Vec3 random_in_circle(){
-    Vec3 curr;
-    for (size_t i = 0; i < 100; i++)
-    {
-        curr.x = (randFloat()-0.5)*2;
-        curr.y = (randFloat()-0.5)*2;
-        curr.z = 0;
-        float mag_squared = vec3_dot(&curr, &curr);
-        if (mag_squared <= 1 && mag_squared != 0){
-            return curr;
-        }
+    float r, phi;
+    if (fabsf(a) > fabsf(b)) {
+        r = a;
+        phi = (M_PI / 4) * (b / a);
+    } else {
+        r = b;
+        phi = (M_PI / 2) - (M_PI / 4) * (a / b);
     }
-    Vec3 ret_vec = {0, 0, 0}; 
-    return ret_vec;
-}
-
-Vec3 rand_hemi_vec(Vec3 *normal){
-    Vec3 rand = rand_unit();
-    if (vec3_dot(normal, &rand) < 0){
-        vec3_invert(&rand, &rand);
+    curr.x = r * cosf(phi);
+    curr.y = r * sinf(phi);
+    return curr;
+}
+
+/* sets t and b so that t, b and the unit vector n are orthonormal (Duff et al. 2017) */
+void orthonormal_basis(Vec3 *n, Vec3 *t, Vec3 *b) {
+    float sign = copysignf(1.0f, n->z);
+    float a = -1.0f / (sign + n->z);
+    float c = n->x * n->y * a;
+    *t = (Vec3){1 + sign * n->x * n->x * a, sign * c, -sign * n->x};
+    *b = (Vec3){c, sign + n->y * n->y * a, -n->y};
+}
+
+/* x * t + y * b + z * n */
+static inline Vec3 basis_to_world(Vec3 *t, Vec3 *b, Vec3 *n, float x, float y, float z) {
+    Vec3 out = {x * t->x + y * b->x + z * n->x, x * t->y + y * b->y + z * n->y, x * t->z + y * b->z + z * n->z};
+    return out;
+}
+
+/* Returns random vector along normal using lambertian reflection, cosine weighted
+over the hemisphere (pdf cos / pi). u is a uniform point of the unit square */
+Vec3 rand_lambertian(Vec3 *normal, Vec2 *u){
+    Vec3 t, b;
+    orthonormal_basis(normal, &t, &b);
+    Vec3 disk = sample_disk(u); // projected up onto the hemisphere
+    float z = sqrtf(max(0, 1 - disk.x * disk.x - disk.y * disk.y));
+    return basis_to_world(&t, &b, normal, disk.x, disk.y, z);
+}
+
+/* Smith lambda of the GGX distribution for a direction with cosine cos_theta to the normal */
+static inline float ggx_lambda(float cos_theta, float alpha) {
+    float cos2 = cos_theta * cos_theta;
+    float tan2 = (1 - cos2) / max(cos2, 1e-12f);
+    return (sqrtf(1 + alpha * alpha * tan2) - 1) * 0.5f;
+}
+
+/* reflects the incoming direction in_dir off a GGX microfacet normal sampled from the
+normals visible from it (Heitz 2018), alpha is the roughness squared and u a uniform point
+of the unit square. The surface is two sided. Returns the weight of the reflection, G2 / G1 of the Smith masking, with the
+fresnel term left to the caller, or 0 if the reflection points into the surface */
+float sample_ggx(Vec3 *in_dir, Vec3 *normal, float alpha, Vec2 *u, Vec3 *out) {
+    Vec3 n = *normal;
+    if (vec3_dot(in_dir, &n) > 0) {
+        vec3_invert(&n, &n);
     }
-    return rand;
-}
-
-/* Returns random vector along normal using lambertian reflection*/
-Vec3 rand_lambertian(Vec3 *normal){
-    Vec3 rand = rand_unit();
-    vec3_add(&rand, normal, &rand);
-    vec3_normalize(&rand, &rand);
-    return rand;
+    alpha = max(alpha, 1e-4f);
+    Vec3 t, b;
+    orthonormal_basis(&n, &t, &b);
+    Vec3 v = {-vec3_dot(in_dir, &t), -vec3_dot(in_dir, &b), -vec3_dot(in_dir, &n)}; // towards the viewer
+    // the visible normals are a disc seen from v, after stretching the lobe to roughness 1
+    Vec3 vh = {alpha * v.x, alpha * v.y, v.z};
+    vec3_normalize(&vh, &vh);
+    float len2 = vh.x * vh.x + vh.y * vh.y;
+    Vec3 t1 = {1, 0, 0};
+    if (len2 > 0) {
+        t1 = (Vec3){-vh.y / sqrtf(len2), vh.x / sqrtf(len2), 0};
+    }
+    Vec3 t2;
+    vec3_cross(&vh, &t1, &t2);
+    float r = sqrtf(u->x);
+    float phi = 2 * M_PI * u->y;
+    float p1 = r * cosf(phi);
+    float p2 = r * sinf(phi);
+    float s = 0.5f * (1 + vh.z);
+    p2 = (1 - s) * sqrtf(max(0, 1 - p1 * p1)) + s * p2;
+    float p3 = sqrtf(max(0, 1 - p1 * p1 - p2 * p2));
+    Vec3 m = {alpha * (p1 * t1.x + p2 * t2.x + p3 * vh.x), alpha * (p1 * t1.y + p2 * t2.y + p3 * vh.y),
+              max(0, p1 * t1.z + p2 * t2.z + p3 * vh.z)};
+    vec3_normalize(&m, &m);
+    float v_dot_m = vec3_dot(&v, &m);
+    Vec3 l = {2 * v_dot_m * m.x - v.x, 2 * v_dot_m * m.y - v.y, 2 * v_dot_m * m.z - v.z};
+    if (l.z <= 0) {
+        return 0;
+    }
+    *out = basis_to_world(&t, &b, &n, l.x, l.y, l.z);
+    float lambda_v = ggx_lambda(v.z, alpha);
+    return (1 + lambda_v) / (1 + lambda_v + ggx_lambda(l.z, alpha));
 }
 
 int get_intersection_point(Plane *p, Ray *r, Vec3 *result) {
@@ -270,4 +349,95 @@ float fresnel_dielectric_cos(float cosi, float ior)
     return result;
 }
 
+/* converts float to IEEE half precision, rounding to nearest even */
+uint16_t float_to_half(float f) {
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    int32_t exp = (int32_t)((x >> 23) & 0xff) - 127 + 15;
+    uint32_t mant = x & 0x7fffff;
+    if (((x >> 23) & 0xff) == 0xff) { // inf or nan
+        return sign | 0x7c00 | (mant ? 0x200 : 0);
+    }
+    if (exp >= 31) { // overflow
+        return sign | 0x7c00;
+    }
+    if (exp <= 0) { // denormal or zero
+        if (exp < -10) {
+            return sign;
+        }
+        mant |= 0x800000;
+        int shift = 14 - exp;
+        uint32_t half_mant = mant >> shift;
+        uint32_t rest = mant & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half_mant & 1))) {
+            half_mant++;
+        }
+        return sign | half_mant;
+    }
+    uint32_t h = sign | ((uint32_t)exp << 10) | (mant >> 13);
+    uint32_t rest = mant & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (h & 1))) {
+        h++; // may carry into the exponent, which is still correct
+    }
+    return h;
+}
+
+float half_to_float(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t x;
+    if (exp == 0) {
+        if (mant == 0) {
+            x = sign;
+        } else { // denormal, normalize it
+            exp = 127 - 15 + 1;
+            while (!(mant & 0x400)) {
+                mant <<= 1;
+                exp--;
+            }
+            x = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+        }
+    } else if (exp == 31) {
+        x = sign | 0x7f800000 | (mant << 13);
+    } else {
+        x = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+    }
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+static inline float sign_not_zero(float v) {
+    return v >= 0 ? 1.0f : -1.0f;
+}
+
+/* packs a unit vector into 32 bits using the octahedral mapping (16 bit per axis) */
+uint32_t oct_encode(Vec3 *n) {
+    float l1 = fabsf(n->x) + fabsf(n->y) + fabsf(n->z);
+    float px = n->x / l1;
+    float py = n->y / l1;
+    if (n->z < 0) { // fold the lower hemisphere over the diagonals
+        float fx = (1 - fabsf(py)) * sign_not_zero(px);
+        float fy = (1 - fabsf(px)) * sign_not_zero(py);
+        px = fx;
+        py = fy;
+    }
+    int16_t qx = (int16_t)lroundf(fminf(fmaxf(px, -1), 1) * 32767.0f);
+    int16_t qy = (int16_t)lroundf(fminf(fmaxf(py, -1), 1) * 32767.0f);
+    return (uint32_t)(uint16_t)qx | ((uint32_t)(uint16_t)qy << 16);
+}
+
+void oct_decode(uint32_t packed, Vec3 *out) {
+    out->x = (float)(int16_t)(packed & 0xffff) / 32767.0f;
+    out->y = (float)(int16_t)(packed >> 16) / 32767.0f;
+    out->z = 1 - fabsf(out->x) - fabsf(out->y);
+    float t = fmaxf(-out->z, 0);
+    out->x += out->x >= 0 ? -t : t;
+    out->y += out->y >= 0 ? -t : t;
+    vec3_normalize(out, out);
+}
+
 #endif // VEC3_H
\ No newline at end of file
@@ -4,21 +4,250 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <omp.h>
+#include <sys/stat.h>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #include "linalg.h"
+#include "blockCompression.h"
+#include "textureCache.h"
+#include "parsing.h"
+
+/* set to 1 to transcode textures to BC1 (color) or BC4 (single channel) blocks at load.
+That is 8x smaller than RGBA8 and 2x smaller than R8 but lossy */
+#ifndef COMPRESS_TEXTURES
+#define COMPRESS_TEXTURES 0
+#endif
+
+/* texel formats. Textures keep the 8 or 16 bits per channel of their file and are only
+converted to floats when sampled. Grey images and textures that are only used by scalar
+properties store a single channel, read back as (v, v, v) */
+enum {
+    TEX_R8,
+    TEX_RGBA8,
+    TEX_R16,
+    TEX_RGBA16,
+    TEX_BC1,
+    TEX_BC4
+};
+
+static inline int is_block_compressed(int format) {
+    return format == TEX_BC1 || format == TEX_BC4;
+}
+
+/* texels are stored in square tiles of TEX_TILE x TEX_TILE, row major inside the tile and
+the tiles row major in the texture. Texels that are close in uv space then mostly share a
+cache line, which row major rows only do horizontally. The last tiles of a row or column
+are padded. Block compressed tiles hold 2x2 blocks of 4x4 texels, row major */
+#define TEX_TILE_SHIFT 3
+#define TEX_TILE (1 << TEX_TILE_SHIFT)
+
+#define TEX_MAX_LEVELS 16
+
+/* one level of the mip chain, each halves the size of the one before down to 1x1 */
+typedef struct {
+    size_t offset;   // of the first texel in bytes, cache line aligned
+    int width;
+    int height;
+    int tiles_x;     // tiles per row
+    int mask_x;      // width - 1 for power of two widths, else 0
+    int mask_y;      // same for the height
+} TextureLevel;
 
 // Struct to represent a texture
 typedef struct {
-    Vec3 *pixels;    // Array of pixels
+    void *texels;    // tiled texels of all levels in format
+    PagedTexels *paged; // set instead of texels if they are read through the page cache
     int width;       // Width of the texture
     int height;      // Height of the texture
+    int format;      // one of TEX_*
+    int level_count;
+    float lod_offset; // log2 of the texel count per uv unit, see GetPixel
+    TextureLevel levels[TEX_MAX_LEVELS];
 } Texture;
 
+/* bytes per texel of the uncompressed formats */
+static inline size_t texel_size(int format) {
+    static const size_t sizes[] = {1, 4, 2, 8};
+    return sizes[format];
+}
+
+static inline size_t tile_bytes(int format) {
+    return is_block_compressed(format) ? 4 * 8 : TEX_TILE * TEX_TILE * texel_size(format);
+}
+
+static inline int is_power_of_two(int n) {
+    return n > 1 && (n & (n - 1)) == 0;
+}
+
+/* fills in the layout of the mip chain of a texture with the given tiled texels */
+Texture make_texture(void *texels, int width, int height, int format) {
+    Texture tex;
+    memset(&tex, 0, sizeof(tex));
+    tex.texels = texels;
+    tex.width = width;
+    tex.height = height;
+    tex.format = format;
+    tex.lod_offset = 0.5f * log2f((float)width * height);
+    size_t offset = 0;
+    while (tex.level_count < TEX_MAX_LEVELS) {
+        TextureLevel *level = &tex.levels[tex.level_count++];
+        level->offset = offset;
+        level->width = width;
+        level->height = height;
+        level->tiles_x = (width + TEX_TILE - 1) >> TEX_TILE_SHIFT;
+        level->mask_x = is_power_of_two(width) ? width - 1 : 0;
+        level->mask_y = is_power_of_two(height) ? height - 1 : 0;
+        size_t tiles_y = (height + TEX_TILE - 1) >> TEX_TILE_SHIFT;
+        offset += (level->tiles_x * tiles_y * tile_bytes(format) + 63) & ~(size_t)63;
+        if (width == 1 && height == 1) {
+            break;
+        }
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+    }
+    return tex;
+}
+
+/* size of the texels of all levels including the padding of the last tiles */
+static inline size_t texture_bytes(Texture *tex) {
+    TextureLevel *last = &tex->levels[tex->level_count - 1];
+    size_t tiles_y = (last->height + TEX_TILE - 1) >> TEX_TILE_SHIFT;
+    return last->offset + last->tiles_x * tiles_y * tile_bytes(tex->format);
+}
+
+/* zeroed storage for the texels of tex. The levels start on cache lines inside it, so
+it has to start on one too */
+void *alloc_texels(Texture *tex) {
+    size_t size = (texture_bytes(tex) + 63) & ~(size_t)63;
+    void *texels = aligned_alloc(64, size);
+    if (!texels) {
+        fprintf(stderr, "Error: Memory allocation failed for texture pixels\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(texels, 0, size);
+    return texels;
+}
+
+/* index of texel x, y in the tiled storage of a level */
+static inline int texel_index(TextureLevel *level, int x, int y) {
+    int tile = (y >> TEX_TILE_SHIFT) * level->tiles_x + (x >> TEX_TILE_SHIFT);
+    return (tile << (2 * TEX_TILE_SHIFT)) + ((y & (TEX_TILE - 1)) << TEX_TILE_SHIFT) + (x & (TEX_TILE - 1));
+}
+
+/* byte offset of texel_index i in a level. For block compressed formats that is the
+offset of its 4x4 block, and t is set to the index of the texel in the block */
+static inline size_t texel_offset(int format, int i, int *t) {
+    if (!is_block_compressed(format)) {
+        *t = 0;
+        return (size_t)i * texel_size(format);
+    }
+    int tile = i >> (2 * TEX_TILE_SHIFT);
+    int y = (i >> TEX_TILE_SHIFT) & (TEX_TILE - 1);
+    int x = i & (TEX_TILE - 1);
+    *t = ((y & 3) << 2) + (x & 3);
+    return (size_t)tile * 32 + ((y >> 2) * 2 + (x >> 2)) * 8;
+}
+
+/* converts the texel (or texel t of the block) at p to floats in [0, 1] */
+static inline Vec3 decode_texel(int format, const char *p, int t) {
+    switch (format) {
+    case TEX_R8: {
+        float v = *(uint8_t *)p * (1.0f / 255);
+        return (Vec3){v, v, v};
+    }
+    case TEX_RGBA8: {
+        uint8_t *c = (uint8_t *)p;
+        return (Vec3){c[0] * (1.0f / 255), c[1] * (1.0f / 255), c[2] * (1.0f / 255)};
+    }
+    case TEX_R16: {
+        float v = *(uint16_t *)p * (1.0f / 65535);
+        return (Vec3){v, v, v};
+    }
+    case TEX_RGBA16: {
+        uint16_t *c = (uint16_t *)p;
+        return (Vec3){c[0] * (1.0f / 65535), c[1] * (1.0f / 65535), c[2] * (1.0f / 65535)};
+    }
+    case TEX_BC1:
+        return bc1_decode_texel((const uint8_t *)p, t);
+    default: {
+        float v = bc4_decode_texel((const uint8_t *)p, t);
+        return (Vec3){v, v, v};
+    }
+    }
+}
+
+/* converts texel i of a level to floats in [0, 1]. Paged textures read it from the page cache */
+static inline Vec3 texture_texel(Texture *tex, TextureLevel *level, int i) {
+    int t;
+    size_t offset = level->offset + texel_offset(tex->format, i, &t);
+    if (tex->paged) {
+        PageFrame *frame;
+        const char *p = pin_texels(tex->paged, offset, &frame);
+        Vec3 v = decode_texel(tex->format, p, t);
+        unpin_texels(frame);
+        return v;
+    }
+    return decode_texel(tex->format, (const char *)tex->texels + offset, t);
+}
+
+/* writes v, rounded to the format, to texel i of a level */
+static inline void store_texel(Texture *tex, TextureLevel *level, int i, Vec3 *v) {
+    char *texels = (char *)tex->texels + level->offset;
+    switch (tex->format) {
+    case TEX_R8:
+        ((uint8_t *)texels)[i] = (uint8_t)(v->x * 255 + 0.5f);
+        break;
+    case TEX_RGBA8: {
+        uint8_t *t = (uint8_t *)texels + i * 4;
+        t[0] = (uint8_t)(v->x * 255 + 0.5f);
+        t[1] = (uint8_t)(v->y * 255 + 0.5f);
+        t[2] = (uint8_t)(v->z * 255 + 0.5f);
+        t[3] = 255;
+        break;
+    }
+    case TEX_R16:
+        ((uint16_t *)texels)[i] = (uint16_t)(v->x * 65535 + 0.5f);
+        break;
+    default: {
+        uint16_t *t = (uint16_t *)texels + i * 4;
+        t[0] = (uint16_t)(v->x * 65535 + 0.5f);
+        t[1] = (uint16_t)(v->y * 65535 + 0.5f);
+        t[2] = (uint16_t)(v->z * 65535 + 0.5f);
+        t[3] = 65535;
+        break;
+    }
+    }
+}
+
+/* fills the levels after the first with 2x2 box filtered copies of the level before.
+Odd sizes clamp the filter at the last row and column */
+void build_mips(Texture *tex) {
+    for (int l = 1; l < tex->level_count; l++) {
+        TextureLevel *src = &tex->levels[l - 1];
+        TextureLevel *dst = &tex->levels[l];
+        for (int y = 0; y < dst->height; y++) {
+            int y0 = y * 2 < src->height ? y * 2 : src->height - 1;
+            int y1 = y * 2 + 1 < src->height ? y * 2 + 1 : y0;
+            for (int x = 0; x < dst->width; x++) {
+                int x0 = x * 2 < src->width ? x * 2 : src->width - 1;
+                int x1 = x * 2 + 1 < src->width ? x * 2 + 1 : x0;
+                Vec3 a = texture_texel(tex, src, texel_index(src, x0, y0));
+                Vec3 b = texture_texel(tex, src, texel_index(src, x1, y0));
+                Vec3 c = texture_texel(tex, src, texel_index(src, x0, y1));
+                Vec3 d = texture_texel(tex, src, texel_index(src, x1, y1));
+                Vec3 avg = {(a.x + b.x + c.x + d.x) * 0.25f, (a.y + b.y + c.y + d.y) * 0.25f,
+                            (a.z + b.z + c.z + d.z) * 0.25f};
+                store_texel(tex, dst, texel_index(dst, x, y), &avg);
+            }
+        }
+    }
+}
+
 typedef struct {
     Vec3 value;
-    Texture tex;
+    Texture *tex; // shared entry of the texture cache
     int uses_texture;
 } Vec3OrTexture;
 
@@ -30,52 +259,516 @@ typedef struct {
     Vec3OrTexture specular;        // Specular
     Vec3OrTexture specular_roughness; // Specular roughness
     Vec3OrTexture specular_color;  // Specular color
+    int flags;                     // MAT_*, see compile_material
+    int shading;                   // SHADE_* class the tracer dispatches on
 } Material;
 
+/* order of the properties in Material, used wherever they are handled generically */
+enum {
+    PROP_COLOR,
+    PROP_METALLIC,
+    PROP_EMISSIVE,
+    PROP_SPECULAR,
+    PROP_ROUGHNESS,
+    PROP_SPECULAR_COLOR,
+    PROP_COUNT
+};
+
+/* 1 for properties that only read the first channel */
+static inline int prop_channels(int prop) {
+    return prop == PROP_COLOR || prop == PROP_SPECULAR_COLOR ? 3 : 1;
+}
+
+static inline Vec3OrTexture *material_prop(Material *m, int prop) {
+    Vec3OrTexture *props[PROP_COUNT] = {&m->color, &m->metallic, &m->emissive, &m->specular,
+                                        &m->specular_roughness, &m->specular_color};
+    return props[prop];
+}
+
+/* what the tracer has to evaluate for a material, so constant and unused properties
+are neither fetched nor computed per hit */
+enum {
+    MAT_TEXTURED = 1,          // some property reads a texture, uv and lod are needed
+    MAT_EMISSIVE = 2,          // constant light, nothing else is read
+    MAT_EMISSIVE_TEXTURE = 4,  // light where the emission texture is nonzero
+    MAT_SPECULAR = 8,          // has a specular layer, fresnel is needed
+    MAT_METALLIC = 16,         // can be metallic
+};
+
+/* shading classes, each gets its own shading kernel in the tracer with the branches
+for flags it does not have stripped out. A material uses the first class that covers
+all its flags, the last one covers everything. SHADE_EMISSIVE is only given to constant
+lights by compile_material, it would cover a plain diffuse material too */
+#define SHADING_CLASSES(X) \
+    X(SHADE_EMISSIVE, MAT_EMISSIVE) \
+    X(SHADE_DIFFUSE, 0) \
+    X(SHADE_DIFFUSE_TEXTURED, MAT_TEXTURED) \
+    X(SHADE_GLOSSY, MAT_SPECULAR) \
+    X(SHADE_GLOSSY_TEXTURED, MAT_TEXTURED | MAT_SPECULAR) \
+    X(SHADE_METALLIC, MAT_SPECULAR | MAT_METALLIC) \
+    X(SHADE_GENERIC, MAT_TEXTURED | MAT_EMISSIVE_TEXTURE | MAT_SPECULAR | MAT_METALLIC)
+
+#define SHADING_ENUM(name, flags) name,
+enum { SHADING_CLASSES(SHADING_ENUM) SHADE_COUNT };
+#undef SHADING_ENUM
+
+int shading_class(int flags) {
+#define SHADING_MATCH(name, class_flags) if (name != SHADE_EMISSIVE && (flags & ~(class_flags)) == 0) return name;
+    SHADING_CLASSES(SHADING_MATCH)
+#undef SHADING_MATCH
+    return SHADE_GENERIC;
+}
+
+/* call whenever the properties of m changed */
+void compile_material(Material *m) {
+    if (!m->emissive.uses_texture && m->emissive.value.x > 0) {
+        m->flags = MAT_EMISSIVE;
+        m->shading = SHADE_EMISSIVE;
+        return;
+    }
+    m->flags = m->emissive.uses_texture ? MAT_EMISSIVE_TEXTURE : 0;
+    for (int p = 0; p < PROP_COUNT; p++) {
+        if (material_prop(m, p)->uses_texture) {
+            m->flags |= MAT_TEXTURED;
+        }
+    }
+    if (m->specular.uses_texture || m->specular.value.x > 0) {
+        m->flags |= MAT_SPECULAR;
+    }
+    if (m->metallic.uses_texture || m->metallic.value.x > 0) {
+        m->flags |= MAT_METALLIC;
+    }
+    m->shading = shading_class(m->flags);
+}
+
+/* texture cache entry, every file is decoded once and shared by all properties using it.
+tex comes first so a Texture * handed out by the cache points to its entry */
+typedef struct {
+    Texture tex;
+    char key[1280]; // file path, or binary scene and record index for mapped texels
+    uint32_t hash;
+    int refs;
+    int owned;    // 0 if the texels belong to a mapped or paged binary scene or cache file
+    int channels; // most channels any property using it reads, see prop_channels
+    MappedFile mapping; // of the disk cache file the texels are in, if any
+} CachedTexture;
+
+typedef struct {
+    CachedTexture **entries;
+    int count;
+} TextureCache;
+
+static TextureCache texture_cache;
+
+/* entry of the name -> material hash table, material is -1 for empty slots */
+typedef struct {
+    char name[64];
+    int material;
+} MaterialSlot;
+
 typedef struct {
     Material *mats;
     int material_count;
+    MaterialSlot *lookup;
+    int lookup_capacity; // power of two
+    int default_material; // index of the fallback for unknown names, -1 until first needed
+    CachedTexture **jobs; // new cache entries waiting for decode_textures
+    int job_count;
 } Materials;
 
-// Function to load a texture from a file
-Texture load_texture(const char *filename) {
-    Texture texture;
-    int channels;
-    unsigned char *data = stbi_load(filename, &texture.width, &texture.height, &channels, 4); // Force 4 channels for RGBA
-    if (!data) {
+/* transcodes all levels of an uncompressed texture to BC1, or BC4 for single channel
+formats, and frees the source. Texels past the edge of a level repeat the last row and
+column so the blocks of the padding do not waste endpoint precision */
+Texture compress_texture(Texture *src) {
+    int format = src->format == TEX_R8 || src->format == TEX_R16 ? TEX_BC4 : TEX_BC1;
+    Texture dst = make_texture(NULL, src->width, src->height, format);
+    dst.texels = alloc_texels(&dst);
+    for (int l = 0; l < src->level_count; l++) {
+        TextureLevel *from = &src->levels[l];
+        TextureLevel *to = &dst.levels[l];
+        for (int by = 0; by < (from->height + 3) / 4; by++) {
+            for (int bx = 0; bx < (from->width + 3) / 4; bx++) {
+                Vec3 texels[16];
+                for (int t = 0; t < 16; t++) {
+                    int x = bx * 4 + (t & 3), y = by * 4 + (t >> 2);
+                    x = x < from->width ? x : from->width - 1;
+                    y = y < from->height ? y : from->height - 1;
+                    texels[t] = texture_texel(src, from, texel_index(from, x, y));
+                }
+                int t;
+                uint8_t *block = (uint8_t *)dst.texels + to->offset + texel_offset(format, texel_index(to, bx * 4, by * 4), &t);
+                if (format == TEX_BC1) {
+                    bc1_encode_block(texels, block);
+                } else {
+                    bc4_encode_block(texels, block);
+                }
+            }
+        }
+    }
+    free(src->texels);
+    return dst;
+}
+
+/* decodes the image file into a texture in the format that fits it, tiles it and builds
+its mip chain. With channels == 1 only the first channel is kept */
+Texture load_texture(const char *filename, MappedFile *file, int channels) {
+    const stbi_uc *bytes = (const stbi_uc *)file->data;
+    int length = (int)file->size;
+    int width, height, file_channels;
+    if (file->size > INT32_MAX || !stbi_info_from_memory(bytes, length, &width, &height, &file_channels)) {
         fprintf(stderr, "Error: Unable to load texture file %s\n", filename);
         exit(EXIT_FAILURE);
     }
-
-    // Allocate memory for pixels
-    texture.pixels = (Vec3 *)malloc(texture.width * texture.height * sizeof(Vec3));
-    if (!texture.pixels) {
-        fprintf(stderr, "Error: Memory allocation failed for texture pixels\n");
-        stbi_image_free(data);
+    int wide = stbi_is_16_bit_from_memory(bytes, length);
+    int grey = file_channels < 3;
+    int components = grey ? 1 : 4;
+    void *data = wide ? (void *)stbi_load_16_from_memory(bytes, length, &width, &height, &file_channels, components)
+                      : (void *)stbi_load_from_memory(bytes, length, &width, &height, &file_channels, components);
+    if (!data) {
+        fprintf(stderr, "Error: Unable to load texture file %s\n", filename);
         exit(EXIT_FAILURE);
     }
+    // scalar maps keep the red channel, like the old float conversion read .x
+    int single = grey || channels == 1;
+    int format = wide ? (single ? TEX_R16 : TEX_RGBA16) : (single ? TEX_R8 : TEX_RGBA8);
+    Texture texture = make_texture(NULL, width, height, format);
+    texture.texels = alloc_texels(&texture);
 
-    // Copy data into pixels
-    for (int i = 0; i < texture.width * texture.height; ++i) {
-        texture.pixels[i].x = (float)data[i * 4]/255;
-        texture.pixels[i].y = (float)data[i * 4 + 1]/255;
-        texture.pixels[i].z = (float)data[i * 4 + 2]/255;
+    // the first channel(s) of every decoded texel are copied to its place in the tiles
+    size_t size = texel_size(format);
+    size_t stride = components * (wide ? 2 : 1);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            memcpy((char *)texture.texels + texel_index(&texture.levels[0], x, y) * size,
+                   (char *)data + ((size_t)y * width + x) * stride, size);
+        }
     }
-
-    // Free original image data
     stbi_image_free(data);
+    build_mips(&texture);
+    if (COMPRESS_TEXTURES) {
+        texture = compress_texture(&texture);
+    }
     return texture;
 }
 
 // Function to free a loaded texture
 void free_texture(Texture *texture) {
-    if (texture->pixels) {
-        free(texture->pixels);
-        texture->pixels = NULL;
+    if (texture->texels) {
+        free(texture->texels);
+        texture->texels = NULL;
         texture->width = 0;
         texture->height = 0;
     }
 }
+
+uint32_t hash_name(const char *name) {
+    uint32_t h = 2166136261u;
+    for (; *name; name++) {
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    }
+    return h;
+}
+
+/* returns the cache entry for key with one more reference. New entries are empty
+and *created is set, the caller fills them in */
+CachedTexture *acquire_texture(const char *key, int *created) {
+    uint32_t hash = hash_name(key);
+    *created = 0;
+    for (int i = 0; i < texture_cache.count; i++) {
+        CachedTexture *entry = texture_cache.entries[i];
+        if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+            entry->refs++;
+            return entry;
+        }
+    }
+    CachedTexture *entry = calloc(1, sizeof(CachedTexture));
+    snprintf(entry->key, sizeof(entry->key), "%s", key);
+    entry->hash = hash;
+    entry->refs = 1;
+    entry->owned = 1;
+    texture_cache.entries = realloc(texture_cache.entries, (texture_cache.count + 1) * sizeof(CachedTexture *));
+    texture_cache.entries[texture_cache.count++] = entry;
+    *created = 1;
+    return entry;
+}
+
+/* drops one reference, the last one frees the texels and the entry */
+void release_texture(Texture *tex) {
+    CachedTexture *entry = (CachedTexture *)tex;
+    if (--entry->refs > 0) {
+        return;
+    }
+    for (int i = 0; i < texture_cache.count; i++) {
+        if (texture_cache.entries[i] == entry) {
+            texture_cache.entries[i] = texture_cache.entries[--texture_cache.count];
+            break;
+        }
+    }
+    if (texture_cache.count == 0) {
+        free(texture_cache.entries);
+        texture_cache.entries = NULL;
+    }
+    if (entry->tex.paged) {
+        free_paged_texels(entry->tex.paged);
+    }
+    if (entry->owned) {
+        free_texture(&entry->tex);
+    }
+    unmap_file(&entry->mapping);
+    free(entry);
+}
+
+/* points a material property at tex, which already carries the reference for it */
+void set_prop_texture(Vec3OrTexture *vot, Texture *tex) {
+    if (vot->uses_texture) { // the property was given twice, the last map wins
+        release_texture(vot->tex);
+    }
+    vot->tex = tex;
+    vot->uses_texture = 1;
+}
+
+/* returns the slot holding name or the empty slot where it belongs */
+MaterialSlot *material_slot(Materials *mats, const char *name) {
+    uint32_t mask = mats->lookup_capacity - 1;
+    uint32_t slot = hash_name(name) & mask;
+    while (mats->lookup[slot].material != -1 && strcmp(mats->lookup[slot].name, name) != 0) {
+        slot = (slot + 1) & mask;
+    }
+    return &mats->lookup[slot];
+}
+
+void add_material_name(Materials *mats, const char *name, int material) {
+    MaterialSlot *slot = material_slot(mats, name);
+    if (slot->material == -1) { // the first material with a name wins
+        snprintf(slot->name, sizeof(slot->name), "%s", name);
+        slot->material = material;
+    }
+}
+
+/* (re)builds the hash table over all material names */
+void build_material_lookup(Materials *mats) {
+    free(mats->lookup);
+    mats->lookup_capacity = 16;
+    while (mats->lookup_capacity < mats->material_count * 4) { // leaves room for unknown names
+        mats->lookup_capacity *= 2;
+    }
+    mats->lookup = malloc(mats->lookup_capacity * sizeof(MaterialSlot));
+    for (int i = 0; i < mats->lookup_capacity; i++) {
+        mats->lookup[i].material = -1;
+    }
+    for (int i = 0; i < mats->material_count; i++) {
+        add_material_name(mats, mats->mats[i].name, i);
+    }
+}
+
+int find_material_by_name(Materials *mats, const char *name) {
+    return material_slot(mats, name)->material; // -1 if not found
+}
+
+/* grey diffuse material used for faces whose material does not exist */
+int get_default_material(Materials *mats) {
+    if (mats->default_material == -1) {
+        mats->default_material = find_material_by_name(mats, "default");
+    }
+    if (mats->default_material == -1) {
+        mats->mats = realloc(mats->mats, (mats->material_count + 1) * sizeof(Material));
+        Material *m = &mats->mats[mats->material_count];
+        memset(m, 0, sizeof(Material));
+        snprintf(m->name, sizeof(m->name), "default");
+        m->color.value = (Vec3){0.8, 0.8, 0.8};
+        m->specular.value = (Vec3){0.5, 0.5, 0.5};
+        m->specular_roughness.value = (Vec3){0.5, 0.5, 0.5};
+        m->specular_color.value = (Vec3){1, 1, 1};
+        compile_material(m);
+        mats->default_material = mats->material_count++;
+        build_material_lookup(mats);
+    }
+    return mats->default_material;
+}
+
+/* returns the material called name. Unknown names are reported once and then map to the default material */
+int resolve_material(Materials *mats, const char *name) {
+    int material = find_material_by_name(mats, name);
+    if (material != -1) {
+        return material;
+    }
+    fprintf(stderr, "Warning: Material '%s' not found, using the default material\n", name);
+    material = get_default_material(mats);
+    if (find_material_by_name(mats, name) == -1) {
+        int used = 0;
+        for (int i = 0; i < mats->lookup_capacity; i++) {
+            used += mats->lookup[i].material != -1;
+        }
+        if (used * 2 >= mats->lookup_capacity) {
+            build_material_lookup(mats); // drops the earlier aliases, they are just reported again
+        }
+        add_material_name(mats, name, material);
+    }
+    return material;
+}
+
+/* points the property at the cached texture of filename. Files that are not in the
+cache yet are queued for decoding */
+void queue_texture(Materials *mats, int material, int prop, const char *filename) {
+    char path[1280];
+    snprintf(path, sizeof(path), "scene/%s", filename);
+    int created;
+    CachedTexture *entry = acquire_texture(path, &created);
+    if (entry->channels < prop_channels(prop)) {
+        entry->channels = prop_channels(prop);
+    }
+    set_prop_texture(material_prop(&mats->mats[material], prop), &entry->tex);
+    if (created) { // the job holds a reference until attach_textures
+        entry->refs++;
+        mats->jobs = realloc(mats->jobs, (mats->job_count + 1) * sizeof(CachedTexture *));
+        mats->jobs[mats->job_count++] = entry;
+    }
+}
+
+/* file of the disk cache: a header followed by the texels exactly like they are in memory,
+tiled with all mip levels */
+#define TEXTURE_DISK_MAGIC "TTTEX"
+#define TEXTURE_DISK_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    int32_t width, height, format;
+    uint64_t size; // of the texels in bytes
+    uint32_t reserved[8];
+} TextureDiskHeader;
+
+/* directory decoded textures are kept in and mapped from on later runs, "" disables it.
+Only the renderer sets it, see load_cached_texture */
+static const char *texture_disk_cache = "";
+
+/* names the disk cache file of an image after a hash of its bytes and the settings it is
+decoded with, so edited images get a new file and renamed or touched ones keep theirs.
+Returns 0 if the cache is disabled */
+int disk_cache_path(MappedFile *image, int channels, char *out, size_t size) {
+    if (texture_disk_cache[0] == '\0') {
+        return 0;
+    }
+    uint64_t hash = 14695981039346656037ull; // 64 bit FNV-1a
+    for (size_t i = 0; i < image->size; i++) {
+        hash = (hash ^ (unsigned char)image->data[i]) * 1099511628211ull;
+    }
+    snprintf(out, size, "%s/%016llx-%d%s.tex", texture_disk_cache, (unsigned long long)hash,
+             channels, COMPRESS_TEXTURES ? "-bc" : "");
+    return 1;
+}
+
+/* points the entry at the texels of a disk cache file, or pages them from it if the page
+cache is enabled. Returns 0 if the file is missing or does not fit */
+int read_disk_texture(const char *path, CachedTexture *entry) {
+    if (access(path, R_OK) != 0) {
+        return 0;
+    }
+    MappedFile file = map_file(path);
+    const TextureDiskHeader *header = (const TextureDiskHeader *)file.data;
+    if (file.size < sizeof(TextureDiskHeader) || memcmp(header->magic, TEXTURE_DISK_MAGIC, sizeof(TEXTURE_DISK_MAGIC)) != 0 ||
+        header->version != TEXTURE_DISK_VERSION || header->format < TEX_R8 || header->format > TEX_BC4 ||
+        header->width <= 0 || header->height <= 0) {
+        unmap_file(&file);
+        return 0;
+    }
+    Texture tex = make_texture((void *)(file.data + sizeof(TextureDiskHeader)), header->width, header->height, header->format);
+    if (header->size != texture_bytes(&tex) || file.size - sizeof(TextureDiskHeader) < header->size) {
+        unmap_file(&file);
+        return 0;
+    }
+    if (page_cache.frame_count > 0) {
+        tex.paged = page_texels(path, sizeof(TextureDiskHeader), header->size);
+    }
+    if (tex.paged) {
+        tex.texels = NULL;
+        unmap_file(&file);
+    } else {
+        madvise((void *)file.data, file.size, MADV_RANDOM);
+        entry->mapping = file;
+    }
+    entry->tex = tex;
+    entry->owned = 0;
+    return 1;
+}
+
+/* writes a decoded texture to the disk cache. The file is written under a temporary name
+and renamed, so other threads and processes never see half of it */
+void write_disk_texture(const char *path, Texture *tex) {
+    mkdir(texture_disk_cache, 0755);
+    char tmp_path[1400];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.%d.tmp", path, (int)getpid(), omp_get_thread_num());
+    FILE *file = fopen(tmp_path, "wb");
+    if (!file) {
+        fprintf(stderr, "Warning: Unable to write texture cache file %s\n", tmp_path);
+        return;
+    }
+    TextureDiskHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TEXTURE_DISK_MAGIC, sizeof(TEXTURE_DISK_MAGIC));
+    header.version = TEXTURE_DISK_VERSION;
+    header.width = tex->width;
+    header.height = tex->height;
+    header.format = tex->format;
+    header.size = texture_bytes(tex);
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(tex->texels, 1, header.size, file) == header.size;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(tmp_path, path) != 0) {
+        fprintf(stderr, "Warning: Unable to write texture cache file %s\n", path);
+        remove(tmp_path);
+    }
+}
+
+/* fills in the texture of a cache entry, mapped from the disk cache if an earlier run
+decoded the same image with the same settings, otherwise decoded and added to it. The
+image is read once, for the hash and the decoder */
+void load_cached_texture(CachedTexture *entry) {
+    if (access(entry->key, R_OK) != 0) {
+        fprintf(stderr, "Error: Unable to load texture file %s\n", entry->key);
+        exit(EXIT_FAILURE);
+    }
+    MappedFile image = map_file(entry->key);
+    char path[1400];
+    int cached = disk_cache_path(&image, entry->channels, path, sizeof(path));
+    if (!cached || !read_disk_texture(path, entry)) {
+        entry->tex = load_texture(entry->key, &image, entry->channels);
+        if (cached) {
+            write_disk_texture(path, &entry->tex);
+        }
+    }
+    unmap_file(&image);
+}
+
+/* decodes the queued textures. Inside a parallel region every texture becomes a task that
+idle threads pick up while the caller goes on with other work (the tasks are done at the
+next barrier), otherwise they are decoded by a parallel loop */
+void decode_textures(Materials *mats) {
+    if (omp_in_parallel()) {
+        for (int i = 0; i < mats->job_count; i++) {
+            CachedTexture *job = mats->jobs[i];
+            #pragma omp task firstprivate(job)
+            load_cached_texture(job);
+        }
+        return;
+    }
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < mats->job_count; i++) {
+        load_cached_texture(mats->jobs[i]);
+    }
+}
+
+/* call once decode_textures has finished. The materials already point at the cache
+entries, which now hold their texels, so only the references of the jobs are dropped */
+void attach_textures(Materials *mats) {
+    for (int i = 0; i < mats->job_count; i++) {
+        release_texture(&mats->jobs[i]->tex);
+    }
+    free(mats->jobs);
+    mats->jobs = NULL;
+    mats->job_count = 0;
+}
+
+/* parses the mtl file. Textures are only queued, see decode_textures and attach_textures */
 Materials load_materials(const char* mtl_filename) {
     FILE* file = fopen(mtl_filename, "r");
     if (!file) {
@@ -85,6 +778,10 @@ Materials load_materials(const char* mtl_filename) {
 
     Materials materials;
     materials.material_count = 0;
+    materials.lookup = NULL;
+    materials.default_material = -1;
+    materials.jobs = NULL;
+    materials.job_count = 0;
     int material_capacity = 10;
     materials.mats = malloc(material_capacity * sizeof(Material));
 
@@ -109,10 +806,7 @@ Materials load_materials(const char* mtl_filename) {
             } else if (strncmp(line, "map_Kd ", 7) == 0) {
                 char texture_filename[1024];
                 sscanf(line, "map_Kd %1023s", texture_filename);
-                char full_path[1280];  // Increased buffer size
-                snprintf(full_path, sizeof(full_path), "scene/%s", texture_filename);
-                current_material->color.tex = load_texture(full_path);
-                current_material->color.uses_texture = 1;
+                queue_texture(&materials, materials.material_count - 1, PROP_COLOR, texture_filename);
             }
             // Metallic
             else if (strncmp(line, "Pm ", 3) == 0) {
@@ -122,10 +816,7 @@ Materials load_materials(const char* mtl_filename) {
             } else if (strncmp(line, "map_Pm ", 7) == 0) {
                 char texture_filename[1024];
                 sscanf(line, "map_Pm %1023s", texture_filename);
-                char full_path[1280];
-                snprintf(full_path, sizeof(full_path), "scene/%s", texture_filename);
-                current_material->metallic.tex = load_texture(full_path);
-                current_material->metallic.uses_texture = 1;
+                queue_texture(&materials, materials.material_count - 1, PROP_METALLIC, texture_filename);
             }
             // Emissive
             else if (strncmp(line, "Ke ", 3) == 0) {
@@ -134,10 +825,7 @@ Materials load_materials(const char* mtl_filename) {
             } else if (strncmp(line, "map_Ke ", 7) == 0) {
                 char texture_filename[1024];
                 sscanf(line, "map_Ke %1023s", texture_filename);
-                char full_path[1280];
-                snprintf(full_path, sizeof(full_path), "scene/%s", texture_filename);
-                current_material->emissive.tex = load_texture(full_path);
-                current_material->emissive.uses_texture = 1;
+                queue_texture(&materials, materials.material_count - 1, PROP_EMISSIVE, texture_filename);
             }
             // Specular
             else if (strncmp(line, "Ks ", 3) == 0) {
@@ -146,10 +834,7 @@ Materials load_materials(const char* mtl_filename) {
             } else if (strncmp(line, "map_Ks ", 7) == 0) {
                 char texture_filename[1024];
                 sscanf(line, "map_Ks %1023s", texture_filename);
-                char full_path[1280];
-                snprintf(full_path, sizeof(full_path), "scene/%s", texture_filename);
-                current_material->specular.tex = load_texture(full_path);
-                current_material->specular.uses_texture = 1;
+                queue_texture(&materials, materials.material_count - 1, PROP_SPECULAR, texture_filename);
             }
             // Specular roughness
             else if (strncmp(line, "Pr ", 3) == 0) {
@@ -159,21 +844,22 @@ Materials load_materials(const char* mtl_filename) {
             } else if (strncmp(line, "map_Pr ", 7) == 0) {
                 char texture_filename[1024];
                 sscanf(line, "map_Pr %1023s", texture_filename);
-                char full_path[1280];
-                snprintf(full_path, sizeof(full_path), "scene/%s", texture_filename);
-                current_material->specular_roughness.tex = load_texture(full_path);
-                current_material->specular_roughness.uses_texture = 1;
+                queue_texture(&materials, materials.material_count - 1, PROP_ROUGHNESS, texture_filename);
             }
         }
     }
     
     fclose(file);
+    for (int i = 0; i < materials.material_count; i++) {
+        compile_material(&materials.mats[i]);
+    }
+    build_material_lookup(&materials);
     return materials;
 }
 
 void free_vec3_or_texture(Vec3OrTexture *vot) {
     if (vot->uses_texture) {
-        free_texture(&vot->tex);
+        release_texture(vot->tex);
     }
     vot->uses_texture = 0;
 }
@@ -197,12 +883,16 @@ void free_materials(Materials mats){
         free_material(&mats.mats[i]);
     }
     free(mats.mats);
+    free(mats.lookup);
+    free(mats.jobs);
 }
 
 void print_vec3_or_texture(const char *label, const Vec3OrTexture *vot, int is_color) {
     printf("  %s: ", label);
     if (vot->uses_texture) {
-        printf("Texture (%dx%d)\n", vot->tex.width, vot->tex.height);
+        static const char *formats[] = {"R8", "RGBA8", "R16", "RGBA16", "BC1", "BC4"};
+        printf("Texture (%dx%d %s, %d levels)\n", vot->tex->width, vot->tex->height, formats[vot->tex->format],
+               vot->tex->level_count);
     } else if (is_color) {
         printf("RGB(%.3f, %.3f, %.3f)\n", vot->value.x, vot->value.y, vot->value.z);
     } else {
@@ -5,13 +5,67 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include "materials.h"
+#include "sampler.h"
+#include "dispatch.h"
+#include "parsing.h"
+#include <omp.h>
+
+/* set to 1 to store normals octahedral encoded in 32 bits and uvs as half floats.
+They are only decoded for the closest hit, so the precision loss is not visible */
+#ifndef COMPRESS_ATTRIBUTES
+#define COMPRESS_ATTRIBUTES 0
+#endif
+
+#if COMPRESS_ATTRIBUTES
+typedef uint32_t PackedNormal;
+typedef struct {
+    uint16_t x, y;
+} PackedUV;
+#else
+typedef Vec3 PackedNormal;
+typedef Vec2 PackedUV;
+#endif
+
+static inline PackedNormal pack_normal(Vec3 *n) {
+#if COMPRESS_ATTRIBUTES
+    return oct_encode(n);
+#else
+    return (Vec3){n->x + 0.0f, n->y + 0.0f, n->z + 0.0f}; // -0 becomes +0 so welding sees them as equal
+#endif
+}
+
+static inline void unpack_normal(PackedNormal *n, Vec3 *out) {
+#if COMPRESS_ATTRIBUTES
+    oct_decode(*n, out);
+#else
+    *out = *n;
+#endif
+}
 
+static inline PackedUV pack_uv(Vec2 *uv) {
+#if COMPRESS_ATTRIBUTES
+    return (PackedUV){float_to_half(uv->x), float_to_half(uv->y)};
+#else
+    return (Vec2){uv->x + 0.0f, uv->y + 0.0f};
+#endif
+}
+
+static inline void unpack_uv(PackedUV *uv, Vec2 *out) {
+#if COMPRESS_ATTRIBUTES
+    out->x = half_to_float(uv->x);
+    out->y = half_to_float(uv->y);
+#else
+    *out = *uv;
+#endif
+}
+
+/* triangle as three indices into the shared vertex buffers of its mesh */
 typedef struct {
-    Vec3 v1, v2, v3;
-    Vec3 vn1, vn2, vn3; // maybe remove later to increase cache locality
-    Vec2 vt1, vt2, vt3; // textures coordinates
-    Material *material;
+    int v[3];
+    int material; // index into Materials
 } Triangle;
 
 typedef struct {
@@ -19,9 +73,18 @@ typedef struct {
     float rad;
 } Sphere;
 
+/* indexed triangle mesh. Positions live in their own array so intersection tests
+only touch 12 bytes per vertex, shading attributes are only read after a hit. Vertices
+are stored in the order they are first referenced, so neighbouring triangles mostly share
+cache lines. */
 typedef struct {
+    Vec3 *positions;
+    PackedNormal *normals;
+    PackedUV *texcoords;
+    int vertex_count;
     Triangle *triangles;
     int count;
+    MappedFile source; // set if the buffers point into a mapped binary scene
 } Triangles;
 
 typedef struct {
@@ -31,124 +94,517 @@ typedef struct {
     float focal_length;
 } Camera;
 
-Material* find_material_by_name(Materials *mats, const char *name) {
-    for (int i = 0; i < mats->material_count; i++) {
-        if (strcmp(mats->mats[i].name, name) == 0) {
-            return &mats->mats[i];
+
+/* the stored bits of one vertex. Vertices are welded when all of them are equal, so
+normals and uvs that quantize to the same values are merged too */
+typedef struct {
+    Vec3 p;
+    PackedNormal n;
+    PackedUV uv;
+} VertexKey;
+
+uint32_t hash_vertex_key(VertexKey *key) {
+    uint32_t words[sizeof(VertexKey) / 4];
+    memcpy(words, key, sizeof(words));
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < sizeof(words) / 4; i++) {
+        h = (h ^ words[i]) * 0x9e3779b1u;
+        h ^= h >> 15;
+    }
+    h *= 0x85ebca6bu;
+    return h ^ (h >> 13);
+}
+
+/* inserts corner c into a shared open addressing table and returns its slot. Threads race
+freely, but the slot of equal keys always ends up holding the smallest corner index, so the
+result is deterministic. Returns -1 once more than limit slots are taken */
+int weld_insert(atomic_int *slots, uint32_t mask, VertexKey *keys, int c, atomic_int *filled, int limit) {
+    uint32_t slot = hash_vertex_key(&keys[c]) & mask;
+    while (1) {
+        int curr = atomic_load_explicit(&slots[slot], memory_order_acquire);
+        if (curr == -1) {
+            if (atomic_compare_exchange_weak(&slots[slot], &curr, c)) {
+                return atomic_fetch_add_explicit(filled, 1, memory_order_relaxed) < limit ? (int)slot : -1;
+            }
+            continue; // someone else took the slot, look at it again
+        }
+        if (memcmp(&keys[curr], &keys[c], sizeof(VertexKey)) == 0) {
+            while (c < curr && !atomic_compare_exchange_weak(&slots[slot], &curr, c)) {}
+            return slot;
         }
+        slot = (slot + 1) & mask;
     }
-    return NULL; // Material not found
 }
-Triangles read_obj_file(const char *filename, Materials *mats) {
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        perror("Error opening file");
+
+/* triangles with zero area can never be hit but still cost an intersection test */
+int is_degenerate(Vec3 *a, Vec3 *b, Vec3 *c) {
+    Vec3 e1, e2, n;
+    vec3_subtract(b, a, &e1);
+    vec3_subtract(c, a, &e2);
+    vec3_cross(&e1, &e2, &n);
+    return vec3_dot(&n, &n) == 0;
+}
+
+/* one face corner of an obj file as 0 based indices, -1 if the attribute is missing */
+typedef struct {
+    int v, vt, vn;
+} ObjCorner;
+
+/* all triangles from first_triangle on use this material, up to the next run */
+typedef struct {
+    int first_triangle;
+    char name[64];
+    int material; // index into Materials, resolved after parsing
+} ObjMaterialRun;
+
+/* raw contents of an obj file, polygons are already split into triangles */
+typedef struct {
+    Vec3 *positions;
+    int position_count, position_capacity;
+    Vec2 *texcoords;
+    int texcoord_count, texcoord_capacity;
+    Vec3 *normals;
+    int normal_count, normal_capacity;
+    ObjCorner *corners; // 3 per triangle
+    int triangle_count, triangle_capacity;
+    ObjMaterialRun *runs;
+    int run_count, run_capacity;
+    int *fixups; // slots in corners (as flat int array) holding a negative index resolved inside this chunk
+    int fixup_count, fixup_capacity;
+} ObjData;
+
+/* makes room for one more element, doubling the capacity when needed */
+void *grow_array(void *arr, int *capacity, int count, size_t elem_size) {
+    if (count < *capacity) {
+        return arr;
+    }
+    *capacity = *capacity > 0 ? *capacity * 2 : 64;
+    arr = realloc(arr, (size_t)*capacity * elem_size);
+    if (!arr) {
+        fprintf(stderr, "Error: Memory allocation failed while reading obj file\n");
         exit(EXIT_FAILURE);
     }
+    return arr;
+}
+
+void free_obj_data(ObjData *d) {
+    free(d->positions);
+    free(d->texcoords);
+    free(d->normals);
+    free(d->corners);
+    free(d->runs);
+    free(d->fixups);
+}
 
-    char line[256];
-    int vertex_capacity = 10;
-    int normal_capacity = 10;
-    int triangle_capacity = 10;
-    int texcoors_capacity = 10;
+/* obj indices start at 1, negative ones count back from the last element read so far */
+static inline int resolve_obj_index(int ind, int count) {
+    if (ind > 0) {
+        return ind - 1;
+    }
+    if (ind < 0) {
+        return count + ind;
+    }
+    return -1;
+}
 
-    Vec3 *vertices = malloc(vertex_capacity * sizeof(Vec3));
-    Vec3 *normals = malloc(normal_capacity * sizeof(Vec3));
-    Vec2 *texCoors = malloc(texcoors_capacity * sizeof(Vec2));
+/* parses a face corner like 3, 3/1, 3//2 or 3/1/2. Returns p unchanged if there is none.
+Bit i of relative is set if attribute i was a negative index, those only point to the right
+element once the elements of the previous chunks are counted */
+const char *parse_obj_corner(const char *p, const char *end, ObjData *d, ObjCorner *out, int *relative) {
+    int v = 0, vt = 0, vn = 0;
+    const char *q = parse_int(p, end, &v);
+    if (q == p) {
+        return p;
+    }
+    if (q < end && *q == '/') {
+        q = parse_int(q + 1, end, &vt);
+        if (q < end && *q == '/') {
+            q = parse_int(q + 1, end, &vn);
+        }
+    }
+    out->v = resolve_obj_index(v, d->position_count);
+    out->vt = resolve_obj_index(vt, d->texcoord_count);
+    out->vn = resolve_obj_index(vn, d->normal_count);
+    *relative = (v < 0) | (vt < 0) << 1 | (vn < 0) << 2;
+    return q;
+}
 
-    int normal_count = 0;
-    int vertex_count = 0;
-    int texcoors_count = 0;
+const char *parse_obj_vec(const char *p, const char *end, float *out, int n) {
+    for (int i = 0; i < n; i++) {
+        out[i] = 0;
+        p = parse_float(skip_spaces(p, end), end, &out[i]);
+    }
+    return p;
+}
+
+/* tokenizes the obj records directly from the buffer, one line at a time */
+void parse_obj(const char *p, const char *end, ObjData *d) {
+    while (p < end) {
+        p = skip_spaces(p, end);
+        if (end - p >= 2 && p[0] == 'v' && is_space(p[1])) {
+            d->positions = grow_array(d->positions, &d->position_capacity, d->position_count, sizeof(Vec3));
+            p = parse_obj_vec(p + 2, end, (float *)&d->positions[d->position_count++], 3);
+        } else if (end - p >= 3 && p[0] == 'v' && p[1] == 't' && is_space(p[2])) {
+            d->texcoords = grow_array(d->texcoords, &d->texcoord_capacity, d->texcoord_count, sizeof(Vec2));
+            p = parse_obj_vec(p + 3, end, (float *)&d->texcoords[d->texcoord_count++], 2);
+        } else if (end - p >= 3 && p[0] == 'v' && p[1] == 'n' && is_space(p[2])) {
+            d->normals = grow_array(d->normals, &d->normal_capacity, d->normal_count, sizeof(Vec3));
+            p = parse_obj_vec(p + 3, end, (float *)&d->normals[d->normal_count++], 3);
+        } else if (end - p >= 2 && p[0] == 'f' && is_space(p[1])) {
+            // polygons are split into a triangle fan around the first corner
+            ObjCorner first, prev, curr;
+            int first_rel = 0, prev_rel = 0, curr_rel = 0;
+            int n = 0;
+            p += 2;
+            while (1) {
+                p = skip_spaces(p, end);
+                const char *next = parse_obj_corner(p, end, d, &curr, &curr_rel);
+                if (next == p) {
+                    break;
+                }
+                p = next;
+                if (n == 0) {
+                    first = curr;
+                    first_rel = curr_rel;
+                } else if (n >= 2) {
+                    d->corners = grow_array(d->corners, &d->triangle_capacity, d->triangle_count, 3 * sizeof(ObjCorner));
+                    int tri = d->triangle_count++;
+                    ObjCorner *c = &d->corners[tri * 3];
+                    c[0] = first;
+                    c[1] = prev;
+                    c[2] = curr;
+                    int rel[3] = {first_rel, prev_rel, curr_rel};
+                    for (int k = 0; k < 3; k++) {
+                        for (int attr = 0; attr < 3; attr++) {
+                            if (rel[k] & (1 << attr)) {
+                                d->fixups = grow_array(d->fixups, &d->fixup_capacity, d->fixup_count, sizeof(int));
+                                d->fixups[d->fixup_count++] = (tri * 3 + k) * 3 + attr;
+                            }
+                        }
+                    }
+                }
+                prev = curr;
+                prev_rel = curr_rel;
+                n++;
+            }
+        } else if (end - p >= 7 && strncmp(p, "usemtl", 6) == 0 && is_space(p[6])) {
+            d->runs = grow_array(d->runs, &d->run_capacity, d->run_count, sizeof(ObjMaterialRun));
+            ObjMaterialRun *run = &d->runs[d->run_count++];
+            run->first_triangle = d->triangle_count;
+            p = parse_token(p + 6, end, run->name, sizeof(run->name));
+        }
+        p = next_line(p, end);
+    }
+}
+
+/* welds the raw obj faces into an indexed mesh and resolves the materials. The faces are
+read from the chunks in order, their indices point into the attributes of d. Vertices end up
+in the order they are first referenced */
+Triangles build_obj_mesh(ObjData *d, ObjData *chunks, int chunk_count, Materials *mats) {
+    // resolve the materials once per run, chunks start with the material the previous one ended with
+    int *first_triangle = malloc((chunk_count + 1) * sizeof(int));
+    int *start_material = malloc(chunk_count * sizeof(int));
+    int material = -1;
+    first_triangle[0] = 0;
+    for (int chunk = 0; chunk < chunk_count; chunk++) {
+        int first_run_start = chunks[chunk].run_count > 0 ? chunks[chunk].runs[0].first_triangle : chunks[chunk].triangle_count;
+        if (material == -1 && first_run_start > 0) { // faces before the first usemtl
+            material = get_default_material(mats);
+        }
+        start_material[chunk] = material;
+        for (int r = 0; r < chunks[chunk].run_count; r++) {
+            ObjMaterialRun *run = &chunks[chunk].runs[r];
+            run->material = resolve_material(mats, run->name);
+            material = run->material;
+        }
+        first_triangle[chunk + 1] = first_triangle[chunk] + chunks[chunk].triangle_count;
+    }
+    int triangle_count = first_triangle[chunk_count];
+    int corner_count = triangle_count * 3;
 
     Triangles mesh;
-    mesh.triangles = malloc(triangle_capacity * sizeof(Triangle));
-    mesh.count = 0;
-    char material_name[64];
-    while (fgets(line, sizeof(line), file)) {
-        if (strncmp(line, "usemtl ", 7) == 0) {
-            sscanf(line, "usemtl %63s", material_name);
-        } else if (strncmp(line, "v ", 2) == 0) {
-            if (vertex_count >= vertex_capacity) {
-                vertex_capacity *= 2;
-                vertices = realloc(vertices, vertex_capacity * sizeof(Vec3));
+    memset(&mesh, 0, sizeof(mesh));
+    mesh.triangles = malloc((triangle_count > 0 ? triangle_count : 1) * sizeof(Triangle));
+    VertexKey *keys = malloc((corner_count > 0 ? corner_count : 1) * sizeof(VertexKey));
+    int degenerate_count = 0;
+    int invalid_count = 0;
+    Vec2 no_uv = {0, 0};
+
+    // pack the corners, dropped triangles are marked with v[0] == -1
+    #pragma omp taskloop grainsize(1) reduction(+:degenerate_count, invalid_count)
+    for (int chunk = 0; chunk < chunk_count; chunk++) {
+        ObjData *faces = &chunks[chunk];
+        int run = -1;
+        int material = start_material[chunk];
+        for (int i = 0; i < faces->triangle_count; i++) {
+            while (run + 1 < faces->run_count && faces->runs[run + 1].first_triangle <= i) {
+                run++;
+                material = faces->runs[run].material;
             }
-            Vec3 v;
-            sscanf(line, "v %f %f %f", &v.x, &v.y, &v.z);
-            vertices[vertex_count++] = v;
-        } else if (strncmp(line, "vt ", 3) == 0) {
-            if (texcoors_count >= texcoors_capacity) {
-                texcoors_capacity *= 2;
-                texCoors = realloc(texCoors, texcoors_capacity * sizeof(Vec2));
+            int g = first_triangle[chunk] + i;
+            Triangle *t = &mesh.triangles[g];
+            t->material = material;
+            t->v[0] = -1;
+            ObjCorner *c = &faces->corners[i * 3];
+            int valid = 1;
+            for (int k = 0; k < 3; k++) {
+                valid &= c[k].v >= 0 && c[k].v < d->position_count;
+                valid &= c[k].vt >= -1 && c[k].vt < d->texcoord_count;
+                valid &= c[k].vn >= -1 && c[k].vn < d->normal_count;
             }
-            Vec2 vt;
-            sscanf(line, "vt %f %f", &vt.x, &vt.y);
-            texCoors[texcoors_count++] = vt;
-        } else if (strncmp(line, "vn ", 3) == 0) {
-            if (normal_count >= normal_capacity) {
-                normal_capacity *= 2;
-                normals = realloc(normals, normal_capacity * sizeof(Vec3));
+            if (!valid) {
+                invalid_count++;
+                continue;
             }
-            Vec3 n;
-            sscanf(line, "vn %f %f %f", &n.x, &n.y, &n.z);
-            normals[normal_count++] = n;
-        } else if (strncmp(line, "f ", 2) == 0) {
-            if (mesh.count >= triangle_capacity) {
-                triangle_capacity *= 2;
-                mesh.triangles = realloc(mesh.triangles, triangle_capacity * sizeof(Triangle));
+            Vec3 *corner_pos[3] = {&d->positions[c[0].v], &d->positions[c[1].v], &d->positions[c[2].v]};
+            if (is_degenerate(corner_pos[0], corner_pos[1], corner_pos[2])) {
+                degenerate_count++;
+                continue;
             }
-            int v1, v2, v3;
-            int vt1, vt2, vt3;
-            int vn1, vn2, vn3;
-            
-            sscanf(line, "f %d/%d/%d %d/%d/%d %d/%d/%d", 
-                   &v1, &vt1, &vn1, &v2, &vt2, &vn2, &v3, &vt3, &vn3);
-            
-            Triangle t;
-            vec3_copy(&vertices[v1 - 1], &t.v1);
-            vec3_copy(&vertices[v2 - 1], &t.v2);
-            vec3_copy(&vertices[v3 - 1], &t.v3);
-            vec2_copy(&texCoors[vt1 - 1], &t.vt1);
-            vec2_copy(&texCoors[vt2 - 1], &t.vt2);
-            vec2_copy(&texCoors[vt3 - 1], &t.vt3);
-            vec3_copy(&normals[vn1 - 1], &t.vn1);
-            vec3_copy(&normals[vn2 - 1], &t.vn2);
-            vec3_copy(&normals[vn3 - 1], &t.vn3);
-            
-            // Find the material by name and set the pointer
-            t.material = find_material_by_name(mats, material_name);
-            if (t.material == NULL) {
-                fprintf(stderr, "Warning: Material '%s' not found\n", material_name);
+            // corners without normal get the flat face normal
+            Vec3 face_normal, e1, e2;
+            vec3_subtract(corner_pos[1], corner_pos[0], &e1);
+            vec3_subtract(corner_pos[2], corner_pos[0], &e2);
+            vec3_cross(&e1, &e2, &face_normal);
+            vec3_normalize(&face_normal, &face_normal);
+            for (int k = 0; k < 3; k++) {
+                VertexKey *key = &keys[g * 3 + k];
+                Vec3 *raw = corner_pos[k];
+                key->p = (Vec3){raw->x + 0.0f, raw->y + 0.0f, raw->z + 0.0f}; // no -0 so equal positions have equal bits
+                key->n = pack_normal(c[k].vn >= 0 ? &d->normals[c[k].vn] : &face_normal);
+                key->uv = pack_uv(c[k].vt >= 0 ? &d->texcoords[c[k].vt] : &no_uv);
             }
+            t->v[0] = 0;
+        }
+    }
+    free(first_triangle);
+    free(start_material);
+
+    // find the first corner with equal bits for every corner. The table is sized for about one
+    // vertex per obj position and doubled in the rare case that there are many more
+    int *first_corner = malloc((corner_count > 0 ? corner_count : 1) * sizeof(int));
+    int task_count = omp_get_num_threads() * 4;
+    uint32_t table_size = 1024;
+    while (table_size < (uint32_t)d->position_count * 2 && table_size < (uint32_t)corner_count * 2) {
+        table_size *= 2;
+    }
+    while (1) {
+        uint32_t mask = table_size - 1;
+        int limit = table_size / 2; // load factor below 0.5
+        atomic_int filled;
+        atomic_init(&filled, 0);
+        int overflow = 0;
+        atomic_int *slots = malloc(table_size * sizeof(atomic_int));
+        #pragma omp taskloop num_tasks(task_count)
+        for (uint32_t i = 0; i < table_size; i++) {
+            atomic_init(&slots[i], -1);
+        }
+        #pragma omp taskloop num_tasks(task_count) shared(filled) reduction(|:overflow)
+        for (int c = 0; c < corner_count; c++) {
+            if (!overflow && mesh.triangles[c / 3].v[0] != -1) {
+                first_corner[c] = weld_insert(slots, mask, keys, c, &filled, limit);
+                overflow = first_corner[c] == -1;
+            }
+        }
+        if (!overflow) {
+            #pragma omp taskloop num_tasks(task_count)
+            for (int c = 0; c < corner_count; c++) {
+                if (mesh.triangles[c / 3].v[0] != -1) {
+                    first_corner[c] = atomic_load_explicit(&slots[first_corner[c]], memory_order_relaxed);
+                }
+            }
+        }
+        free(slots);
+        if (!overflow) {
+            break;
+        }
+        table_size *= 2;
+    }
 
-            mesh.triangles[mesh.count++] = t;
+    // number the unique vertices in order of first use, first_corner becomes the vertex index
+    int vertex_count = 0;
+    for (int c = 0; c < corner_count; c++) {
+        if (mesh.triangles[c / 3].v[0] != -1 && first_corner[c] == c) {
+            vertex_count++;
         }
     }
+    int vertex_alloc = vertex_count > 0 ? vertex_count : 1;
+    mesh.positions = malloc(vertex_alloc * sizeof(Vec3));
+    mesh.normals = malloc(vertex_alloc * sizeof(PackedNormal));
+    mesh.texcoords = malloc(vertex_alloc * sizeof(PackedUV));
+    mesh.vertex_count = 0;
+    mesh.count = 0;
+    for (int i = 0; i < triangle_count; i++) {
+        Triangle t = mesh.triangles[i];
+        if (t.v[0] == -1) {
+            continue;
+        }
+        for (int k = 0; k < 3; k++) {
+            int c = i * 3 + k;
+            if (first_corner[c] == c) {
+                int ind = mesh.vertex_count++;
+                mesh.positions[ind] = keys[c].p;
+                mesh.normals[ind] = keys[c].n;
+                mesh.texcoords[ind] = keys[c].uv;
+                first_corner[c] = ind;
+            } else {
+                first_corner[c] = first_corner[first_corner[c]]; // earlier corner, already numbered
+            }
+            t.v[k] = first_corner[c];
+        }
+        mesh.triangles[mesh.count++] = t;
+    }
+    free(first_corner);
+    free(keys);
+
+    // release the slack of dropped triangles
+    mesh.triangles = realloc(mesh.triangles, (mesh.count > 0 ? mesh.count : 1) * sizeof(Triangle));
+    printf("Loaded %d triangles, welded %d corners into %d vertices (%d bytes each), removed %d degenerate triangles\n",
+           mesh.count, corner_count, mesh.vertex_count, (int)sizeof(VertexKey), degenerate_count);
+    if (invalid_count > 0) {
+        fprintf(stderr, "Warning: Skipped %d faces with out of range indices\n", invalid_count);
+    }
+    return mesh;
+}
 
-    free(vertices);
-    free(normals);
-    free(texCoors);
-    fclose(file);
+/* gathers the vertex attributes of all chunks in file order. Positive obj indices are
+already global, negative ones are shifted in place by the number of elements in the chunks
+before. The faces and material runs stay in their chunks */
+ObjData merge_obj_chunks(ObjData *chunks, int chunk_count) {
+    ObjData merged;
+    memset(&merged, 0, sizeof(merged));
+    int *bases = malloc(chunk_count * 3 * sizeof(int)); // position, texcoord, normal
+    for (int i = 0; i < chunk_count; i++) {
+        bases[i * 3] = merged.position_count;
+        bases[i * 3 + 1] = merged.texcoord_count;
+        bases[i * 3 + 2] = merged.normal_count;
+        merged.position_count += chunks[i].position_count;
+        merged.texcoord_count += chunks[i].texcoord_count;
+        merged.normal_count += chunks[i].normal_count;
+    }
+    merged.positions = malloc((merged.position_count + 1) * sizeof(Vec3));
+    merged.texcoords = malloc((merged.texcoord_count + 1) * sizeof(Vec2));
+    merged.normals = malloc((merged.normal_count + 1) * sizeof(Vec3));
+    if (!merged.positions || !merged.texcoords || !merged.normals) {
+        fprintf(stderr, "Error: Memory allocation failed while reading obj file\n");
+        exit(EXIT_FAILURE);
+    }
+    merged.position_capacity = merged.position_count;
+    merged.texcoord_capacity = merged.texcoord_count;
+    merged.normal_capacity = merged.normal_count;
+
+    #pragma omp taskloop grainsize(1)
+    for (int i = 0; i < chunk_count; i++) {
+        ObjData *c = &chunks[i];
+        int *base = &bases[i * 3];
+        memcpy(&merged.positions[base[0]], c->positions, c->position_count * sizeof(Vec3));
+        memcpy(&merged.texcoords[base[1]], c->texcoords, c->texcoord_count * sizeof(Vec2));
+        memcpy(&merged.normals[base[2]], c->normals, c->normal_count * sizeof(Vec3));
+        int *slots = (int *)c->corners;
+        for (int f = 0; f < c->fixup_count; f++) {
+            int slot = c->fixups[f];
+            slots[slot] += base[slot % 3];
+        }
+    }
+    free(bases);
+    return merged;
+}
 
+/* maps the obj file and parses newline aligned chunks of it in parallel, in place.
+No line buffers or sscanf involved. The work is split into tasks, so this has to run on
+one thread of a parallel region (see read_obj_file) */
+Triangles parse_obj_file(const char *filename, Materials *mats) {
+    double start = omp_get_wtime();
+    MappedFile file = map_file(filename);
+    const char *end = file.data + file.size;
+    // a few chunks per thread so dynamic scheduling evens out slow chunks
+    int chunk_count = omp_get_max_threads() * 4;
+    size_t min_chunk_size = 1 << 20;
+    if (file.size / min_chunk_size < (size_t)chunk_count) {
+        chunk_count = (int)(file.size / min_chunk_size) + 1;
+    }
+    const char **bounds = malloc((chunk_count + 1) * sizeof(char *));
+    bounds[0] = file.data;
+    for (int i = 1; i < chunk_count; i++) {
+        const char *split = file.data + file.size / chunk_count * i;
+        bounds[i] = split > bounds[i - 1] ? next_line(split, end) : bounds[i - 1];
+    }
+    bounds[chunk_count] = end;
+
+    ObjData *chunks = calloc(chunk_count, sizeof(ObjData));
+    #pragma omp taskloop grainsize(1)
+    for (int i = 0; i < chunk_count; i++) {
+        parse_obj(bounds[i], bounds[i + 1], &chunks[i]);
+    }
+    free(bounds);
+    unmap_file(&file);
+    ObjData attributes = chunk_count == 1 ? chunks[0] : merge_obj_chunks(chunks, chunk_count);
+    printf("Parsed %s in %f seconds (%d chunks)\n", filename, omp_get_wtime() - start, chunk_count);
+
+    Triangles mesh = build_obj_mesh(&attributes, chunks, chunk_count, mats);
+    if (chunk_count > 1) {
+        free_obj_data(&attributes);
+    }
+    for (int i = 0; i < chunk_count; i++) {
+        free_obj_data(&chunks[i]);
+    }
+    free(chunks);
+    return mesh;
+}
+
+Triangles read_obj_file(const char *filename, Materials *mats) {
+    if (omp_in_parallel()) {
+        return parse_obj_file(filename, mats);
+    }
+    Triangles mesh;
+    #pragma omp parallel
+    #pragma omp single
+    mesh = parse_obj_file(filename, mats);
     return mesh;
 }
 
+/* loads the materials and the mesh. The textures are decoded by tasks that run next to
+the parsing and welding tasks of the obj file */
+void load_obj_scene(const char *obj_filename, const char *mtl_filename, Triangles *mesh, Materials *mats) {
+    double start = omp_get_wtime();
+    *mats = load_materials(mtl_filename);
+    int texture_count = mats->job_count;
+    #pragma omp parallel
+    #pragma omp single
+    {
+        decode_textures(mats);
+        *mesh = parse_obj_file(obj_filename, mats);
+    }
+    attach_textures(mats);
+    printf("Loaded %s and %d textures in %f seconds\n", obj_filename, texture_count, omp_get_wtime() - start);
+}
+
 void free_triangles(Triangles *mesh) {
+    if (mesh->source.data) {
+        unmap_file(&mesh->source);
+        return;
+    }
     free(mesh->triangles);
+    free(mesh->positions);
+    free(mesh->normals);
+    free(mesh->texcoords);
 }
 
-/* checks if ray intersects triangle and stores barycentric coordinates in out*/
-int ray_intersects_triangle(Ray *ray, Triangle *triangle, Vec3 *out) {
+/* checks if ray intersects triangle (v1, v2, v3) and stores barycentric coordinates in out.
+Always inlined, so the innermost test of the traversal is built for every clone of the
+HOT_KERNEL that calls it instead of going through the generic version */
+static inline __attribute__((always_inline)) int ray_intersects_triangle(Ray *ray, Vec3 *v1, Vec3 *v2, Vec3 *v3, Vec3 *out) {
     const float epsilon = 1e-6;
     Vec3 e1, e2, e2_cross_raydir, b_cross_e1, b;
-    vec3_subtract(&triangle->v2, &triangle->v1, &e1);
-    vec3_subtract(&triangle->v3, &triangle->v1, &e2);
+    vec3_subtract(v2, v1, &e1);
+    vec3_subtract(v3, v1, &e2);
     vec3_cross(&ray->direction, &e2, &e2_cross_raydir);
     float det = vec3_dot(&e1, &e2_cross_raydir);
     if (det <= epsilon && -det <= epsilon) {
         return 0; // no solution because ray is parallel to triangle plane
     }
     float inv_det = 1.0 / det; // calculate once because div is expensive
-    vec3_subtract(&ray->origin, &triangle->v1, &b);
+    vec3_subtract(&ray->origin, v1, &b);
 
     float u = inv_det * vec3_dot(&e2_cross_raydir, &b); // u
     if (u < 0 || u > 1.0) {
@@ -170,7 +626,7 @@ int ray_intersects_triangle(Ray *ray, Triangle *triangle, Vec3 *out) {
 }
 
 /* Can also be used for BVH in the future!!! Thanks to https://tavianator.com/2015/ray_box_nan.html */
-int ray_intersects_box(Ray *ray, Vec3 *box_min, Vec3 *box_max) {
+HOT_KERNEL int ray_intersects_box(Ray *ray, Vec3 *box_min, Vec3 *box_max) {
     float tmin = -INFINITY, tmax = INFINITY;
     float *bmin = (float *)box_min;
     float *bmax = (float *)box_max;
@@ -201,12 +657,16 @@ int point_in_box(Vec3 *p, Vec3 *box_min, Vec3 *box_max){
 
 /* function which checks if a triangle is inside a voxel. Does not always give correct result,
 but if it returns zero it is guaranteed to not intersect! */
-int triangle_intersects_voxel_heuristic(Triangle *t, Vec3 *voxel_min, float boxsize) {
-    Vec3 voxel_max;
-    vec3_add(voxel_min, &(Vec3){boxsize, boxsize, boxsize}, &voxel_max);
+int triangle_intersects_voxel_heuristic(Triangles *mesh, Triangle *t, Vec3 *voxel_min, float boxsize) {
+    // padded a little, so triangles lying on a face of the voxel are not lost to rounding
+    float pad = boxsize * 1e-4f;
+    Vec3 padded_min, voxel_max;
+    vec3_subtract(voxel_min, &(Vec3){pad, pad, pad}, &padded_min);
+    vec3_add(voxel_min, &(Vec3){boxsize + pad, boxsize + pad, boxsize + pad}, &voxel_max);
+    voxel_min = &padded_min;
 
     // Check if any vertex is inside the voxel
-    Vec3 vertices[3] = {t->v1, t->v2, t->v3};
+    Vec3 vertices[3] = {mesh->positions[t->v[0]], mesh->positions[t->v[1]], mesh->positions[t->v[2]]};
     for (int i = 0; i < 3; i++) {
         if (point_in_box(&vertices[i], voxel_min, &voxel_max)){
             return 1;
@@ -228,11 +688,11 @@ int triangle_intersects_voxel_heuristic(Triangle *t, Vec3 *voxel_min, float boxs
 
     // Check if the triangle PLANE intersects the voxel
     Vec3 e1, e2, normal;
-    vec3_subtract(&t->v2, &t->v1, &e1);
-    vec3_subtract(&t->v3, &t->v1, &e2);
+    vec3_subtract(&vertices[1], &vertices[0], &e1);
+    vec3_subtract(&vertices[2], &vertices[0], &e2);
     vec3_cross(&e1, &e2, &normal); // triangle normal
     
-    float d = -vec3_dot(&normal, &t->v1);
+    float d = -vec3_dot(&normal, &vertices[0]);
     float sign = 0;
     for (size_t i = 0; i < 8; i++)
     {
@@ -254,14 +714,22 @@ int triangle_intersects_voxel_heuristic(Triangle *t, Vec3 *voxel_min, float boxs
     return 0;
 }
 
+/* angle between the rays through neighbouring pixels, the initial spread of a ray cone */
+float camera_pixel_spread(Camera *cam) {
+    return 1.0f / ((float)cam->height * cam->focal_length);
+}
+
 /* converts 2d pixel to camera ray */
-int screen2CameraDir(Camera *cam, float dof, float dof_plane, int screenPos_x, int screenPos_y, Ray *result) {
-    Vec3 rand_dof = random_in_circle();
+int screen2CameraDir(Camera *cam, float dof, float dof_plane, int screenPos_x, int screenPos_y, Ray *result,
+                     Sampler *sampler) {
+    Vec2 jitter = sample_2d(sampler);
+    Vec2 lens = sample_2d(sampler);
+    Vec3 rand_dof = sample_disk(&lens);
     vec3_scale(&rand_dof, dof, &rand_dof);
     vec3_add(&rand_dof, &cam->position, &result->origin);
 
-    float x = (float) screenPos_x + randFloat(); // add small rand value to achieve "antialiasing"
-    float y = (float) screenPos_y + randFloat();
+    float x = (float) screenPos_x + jitter.x; // add small rand value to achieve "antialiasing"
+    float y = (float) screenPos_y + jitter.y;
     Vec3 cam_coor = {
         x / (float)cam->height,
         y / (float)cam->height,
@@ -280,57 +748,78 @@ int screen2CameraDir(Camera *cam, float dof, float dof_plane, int screenPos_x, i
 }
 
 int modulo(int x,int N){
-    return (x % N + N) %N;
+    int r = x % N;
+    return r < 0 ? r + N : r;
+}
+
+/* Gets pixel from texture coordinate. lod is log2 of the footprint in uv units (see
+GetTriangleLOD) plus a random number in [0, 1), so rounding it down picks the two nearest
+mip levels with the right weights. Power of two sizes wrap with a mask */
+Vec3 GetPixel(Vec2 *vc, Texture *tex, float lod){
+    float level_f = lod + tex->lod_offset; // -inf or nan for triangles without uv area
+    int l = level_f > 0 ? (int)fminf(level_f, tex->level_count - 1) : 0;
+    TextureLevel *level = &tex->levels[l];
+    int x = ((int) (vc->x*level->width));
+    x = level->mask_x ? x & level->mask_x : modulo(x, level->width);
+    int y = (level->height - (int) (vc->y*level->height));
+    y = level->mask_y ? y & level->mask_y : modulo(y, level->height);
+    return texture_texel(tex, level, texel_index(level, x, y));
 }
 
-/* Gets pixel from texture coordinate */
-Vec3 GetPixel(Vec2 *vc, Texture *tex){
-    int x = ((int) (vc->x*tex->width));
-    x = modulo(x, tex->width);
-    int y = (tex->height - (int) (vc->y*tex->height));
-    y = modulo(y, tex->height);
-    return tex->pixels[y*tex->width+x];
+/* ray cone texture lod of a hit: log2 of the uv footprint of a cone of the given width
+hitting the triangle at cos_angle to its normal. The triangle part is the square root of
+its uv area per world area (Akenine-Moeller et al., texture level of detail with ray cones) */
+float GetTriangleLOD(Triangles *mesh, Triangle *t, float cone_width, float cos_angle){
+    Vec3 e1, e2, cross;
+    vec3_subtract(&mesh->positions[t->v[1]], &mesh->positions[t->v[0]], &e1);
+    vec3_subtract(&mesh->positions[t->v[2]], &mesh->positions[t->v[0]], &e2);
+    vec3_cross(&e1, &e2, &cross);
+    float world_area = vec3_magnitude(&cross);
+    Vec2 vt1, vt2, vt3;
+    unpack_uv(&mesh->texcoords[t->v[0]], &vt1);
+    unpack_uv(&mesh->texcoords[t->v[1]], &vt2);
+    unpack_uv(&mesh->texcoords[t->v[2]], &vt3);
+    float uv_area = fabsf((vt2.x - vt1.x) * (vt3.y - vt1.y) - (vt3.x - vt1.x) * (vt2.y - vt1.y));
+    cos_angle = fmaxf(fabsf(cos_angle), 1e-4f);
+    return 0.5f * log2f(uv_area / world_area) + log2f(cone_width / cos_angle);
 }
 
-/* Gets pixel from barycentric coordinates */
-Vec3 GetPixelFromTria(Texture *tex, Triangle *t, Vec3 *barycentric){
+/* interpolates the texture coordinate at barycentric coordinates */
+void GetTriangleUV(Triangles *mesh, Triangle *t, Vec3 *barycentric, Vec2 *out){
+    Vec2 vt1, vt2, vt3;
+    unpack_uv(&mesh->texcoords[t->v[0]], &vt1);
+    unpack_uv(&mesh->texcoords[t->v[1]], &vt2);
+    unpack_uv(&mesh->texcoords[t->v[2]], &vt3);
     Vec2 e1, e2;
-    vec2_subtract(&t->vt2, &t->vt1, &e1);
-    vec2_subtract(&t->vt3, &t->vt1, &e2);
+    vec2_subtract(&vt2, &vt1, &e1);
+    vec2_subtract(&vt3, &vt1, &e2);
     vec2_scale(&e1, barycentric->y, &e1);
     vec2_scale(&e2, barycentric->z, &e2);
-    Vec2 coor;
-    vec2_copy(&t->vt1, &coor);
-    vec2_add(&coor, &e1, &coor);
-    vec2_add(&coor, &e2, &coor);
-    return GetPixel(&coor, tex);
+    vec2_copy(&vt1, out);
+    vec2_add(out, &e1, out);
+    vec2_add(out, &e2, out);
 }
 
-void GetTriangleNormal(Triangle *triangle, Vec3 *barycentric, Vec3 *out){
+void GetTriangleNormal(Triangles *mesh, Triangle *triangle, Vec3 *barycentric, Vec3 *out){
     float u = barycentric->y;
     float v = barycentric->z;
     float w = 1 - u - v;
     Vec3 vn1, vn2, vn3;
-    vec3_scale(&triangle->vn1, w, &vn1);
-    vec3_scale(&triangle->vn2, u, &vn2);
-    vec3_scale(&triangle->vn3, v, &vn3);
+    unpack_normal(&mesh->normals[triangle->v[0]], &vn1);
+    unpack_normal(&mesh->normals[triangle->v[1]], &vn2);
+    unpack_normal(&mesh->normals[triangle->v[2]], &vn3);
+    vec3_scale(&vn1, w, &vn1);
+    vec3_scale(&vn2, u, &vn2);
+    vec3_scale(&vn3, v, &vn3);
     vec3_add(&vn1, &vn2, out);
     vec3_add(out, &vn3, out);
     vec3_normalize(out, out); // TODO: maybe not needed
 }
 
-int reflect(Ray *ray, Triangle *triangle, Vec3 *tria_normal, Vec3 *out){
-    // Reflect the ray direction along the normal
-    float dot_prod = vec3_dot(&ray->direction, tria_normal);
-    vec3_scale(tria_normal, -2 * dot_prod, out);
-    vec3_add(&ray->direction, out, out);
-    return 1;
-}
-
 /* returns value of material property. Reads from texture if it exists */
-Vec3 get_prop_val(Vec3OrTexture *vot, Triangle *triangle, Vec3 *barycentric) {
+Vec3 get_prop_val(Vec3OrTexture *vot, Vec2 *uv, float lod) {
     if (vot->uses_texture) {
-        return GetPixelFromTria(&vot->tex, triangle, barycentric);
+        return GetPixel(uv, vot->tex, lod);
     } else {
         return vot->value;
     }
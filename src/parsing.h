@@ -0,0 +1,172 @@
+#ifndef PARSING_H
+#define PARSING_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* read only view of a whole file */
+typedef struct {
+    const char *data;
+    size_t size;
+} MappedFile;
+
+MappedFile map_file(const char *filename) {
+    MappedFile file = {NULL, 0};
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        perror("Error opening file");
+        exit(EXIT_FAILURE);
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("Error reading file size");
+        exit(EXIT_FAILURE);
+    }
+    file.size = (size_t)st.st_size;
+    if (file.size > 0) {
+        void *data = mmap(NULL, file.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            perror("Error mapping file");
+            exit(EXIT_FAILURE);
+        }
+        madvise(data, file.size, MADV_SEQUENTIAL);
+        file.data = data;
+    }
+    close(fd);
+    return file;
+}
+
+void unmap_file(MappedFile *file) {
+    if (file->data) {
+        munmap((void *)file->data, file->size);
+    }
+    file->data = NULL;
+    file->size = 0;
+}
+
+static inline int is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline int is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static inline const char *skip_spaces(const char *p, const char *end) {
+    while (p < end && is_space(*p)) {
+        p++;
+    }
+    return p;
+}
+
+/* returns the start of the next line */
+static inline const char *next_line(const char *p, const char *end) {
+    const char *nl = memchr(p, '\n', end - p);
+    return nl ? nl + 1 : end;
+}
+
+/* copies the next whitespace separated token (truncated to size-1 chars) and returns the end of it */
+const char *parse_token(const char *p, const char *end, char *out, size_t size) {
+    p = skip_spaces(p, end);
+    size_t n = 0;
+    while (p < end && !is_space(*p) && *p != '\n') {
+        if (n + 1 < size) {
+            out[n++] = *p;
+        }
+        p++;
+    }
+    out[n] = '\0';
+    return p;
+}
+
+/* parses a signed decimal integer. Returns p unchanged if there is none */
+const char *parse_int(const char *p, const char *end, int *out) {
+    const char *start = p;
+    int neg = 0;
+    if (p < end && (*p == '-' || *p == '+')) {
+        neg = *p == '-';
+        p++;
+    }
+    if (p >= end || !is_digit(*p)) {
+        return start;
+    }
+    int v = 0;
+    while (p < end && is_digit(*p)) {
+        v = v * 10 + (*p - '0');
+        p++;
+    }
+    *out = neg ? -v : v;
+    return p;
+}
+
+/* parses a decimal float like 1, -0.25 or 3.5e-4 without going through the locale aware
+strtof. Up to 19 significant digits are collected in an integer and scaled once by an
+exact power of ten, which is plenty for float. Returns p unchanged if there is no number */
+const char *parse_float(const char *p, const char *end, float *out) {
+    static const double pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+        1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const char *start = p;
+    int neg = 0;
+    if (p < end && (*p == '-' || *p == '+')) {
+        neg = *p == '-';
+        p++;
+    }
+    uint64_t mant = 0;
+    int digits = 0; // significant digits stored in mant
+    int exp10 = 0;
+    int any = 0;
+    while (p < end && is_digit(*p)) {
+        if (digits < 19) {
+            mant = mant * 10 + (*p - '0');
+            digits += mant != 0;
+        } else {
+            exp10++;
+        }
+        any = 1;
+        p++;
+    }
+    if (p < end && *p == '.') {
+        p++;
+        while (p < end && is_digit(*p)) {
+            if (digits < 19) {
+                mant = mant * 10 + (*p - '0');
+                digits += mant != 0;
+                exp10--;
+            }
+            any = 1;
+            p++;
+        }
+    }
+    if (!any) {
+        return start;
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        int e = 0;
+        const char *exp_end = parse_int(p + 1, end, &e);
+        if (exp_end != p + 1) {
+            exp10 += e;
+            p = exp_end;
+        }
+    }
+    double v = (double)mant;
+    if (mant != 0) {
+        if (exp10 < 0) {
+            v = -exp10 <= 22 ? v / pow10[-exp10] : v * pow(10, exp10);
+        } else if (exp10 > 0) {
+            v = exp10 <= 22 ? v * pow10[exp10] : v * pow(10, exp10);
+        }
+    }
+    *out = (float)(neg ? -v : v);
+    return p;
+}
+
+#endif // PARSING_H
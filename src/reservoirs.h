@@ -0,0 +1,162 @@
+#ifndef RESERVOIRS_H
+#define RESERVOIRS_H
+#include "spatial.h"
+
+/* direct light of the first diffuse hit of every pixel by reservoir resampling (ReSTIR).
+trace leaves that light out and records the hit instead. Then every pixel draws a few
+candidate lights from the light tree into a reservoir, keeping one with probability
+proportional to its unshadowed contribution, and merges in the reservoirs of some
+neighbours. Only the kept sample gets a shadow ray, so one shadow ray does the work of
+the many candidates the merged reservoirs have seen.
+
+Only spatial reuse is done, every pass starts from new reservoirs. Reusing those of the
+last pass correlates the passes that are averaged into the image, which made the result
+worse than no reuse.
+
+The reservoirs are merged with the simple 1/M weights, which darkens a little where
+neighbours see different lights (shadow edges). Neighbours with a different normal or
+depth are not merged to keep that small */
+#define RESAMPLE_CANDIDATES 8
+#define RESAMPLE_NEIGHBORS 3
+#define RESAMPLE_RADIUS 10 // pixels
+/* first sampler dimensions of the two passes, far after those of the paths */
+#define RESAMPLE_CANDIDATE_DIMENSION 1024
+#define RESAMPLE_NEIGHBOR_DIMENSION (RESAMPLE_CANDIDATE_DIMENSION + 3 * RESAMPLE_CANDIDATES)
+
+typedef struct {
+    Vec3 point, normal;
+    Vec3 throughput; // of the path up to the hit, including its color
+    float depth;     // distance from the camera
+    int valid;       // 0 if the camera ray did not end on a diffuse hit
+} PrimaryHit;
+
+typedef struct {
+    Vec3 light_point;
+    int light;   // triangle, -1 if the reservoir is empty
+    float w_sum; // sum of the resampling weights seen
+    float W;     // contribution weight of the kept sample, an estimate of 1 / its pdf
+    int M;       // candidates seen
+} Reservoir;
+
+static inline void reservoir_clear(Reservoir *r) {
+    r->light = -1;
+    r->w_sum = 0;
+    r->W = 0;
+    r->M = 0;
+}
+
+/* streams a sample with weight w and M candidates behind it into r */
+static inline void reservoir_update(Reservoir *r, int light, Vec3 *light_point, float w, int M, Sampler *sampler) {
+    r->M += M;
+    if (w <= 0) {
+        return;
+    }
+    r->w_sum += w;
+    if (sample_1d(sampler) * r->w_sum <= w) {
+        r->light = light;
+        r->light_point = *light_point;
+    }
+}
+
+/* unshadowed light of a point on a light arriving at the hit, without the diffuse 1/pi */
+float resample_target(Scene *scene, PrimaryHit *hit, int light, Vec3 *light_point) {
+    Triangle *t = &scene->triangles->triangles[light];
+    Vec3 light_normal, to_light;
+    triangle_area(scene->triangles, t, &light_normal);
+    vec3_subtract(light_point, &hit->point, &to_light);
+    float dist2 = vec3_dot(&to_light, &to_light);
+    if (dist2 <= 0) {
+        return 0;
+    }
+    float dist = sqrtf(dist2);
+    float cos_surface = vec3_dot(&hit->normal, &to_light) / dist;
+    if (cos_surface <= 0) {
+        return 0;
+    }
+    float cos_light = fabsf(vec3_dot(&light_normal, &to_light)) / dist;
+    return scene->materials.mats[t->material].emissive.value.x * cos_surface * cos_light / dist2;
+}
+
+/* sets W of r from the target of its sample at hit */
+static inline void reservoir_finalize(Scene *scene, PrimaryHit *hit, Reservoir *r) {
+    float target = r->light >= 0 ? resample_target(scene, hit, r->light, &r->light_point) : 0;
+    r->W = target > 0 ? r->w_sum / (r->M * target) : 0;
+}
+
+/* 1 if nothing is between the hit and the point on the light */
+int light_visible(Scene *scene, PrimaryHit *hit, int light, Vec3 *light_point) {
+    Ray shadow_ray;
+    shadow_ray.origin = hit->point;
+    vec3_subtract(light_point, &hit->point, &shadow_ray.direction);
+    float dist = vec3_magnitude(&shadow_ray.direction);
+    vec3_scale(&shadow_ray.direction, 1 / dist, &shadow_ray.direction);
+    Vec3 barycentric;
+    int blocker = castRay(&shadow_ray, scene, &barycentric);
+    return blocker == light || (blocker != -1 && barycentric.x >= dist * (1 - 1e-3f));
+}
+
+/* fills out with candidates from the light tree */
+void resample_candidates(Scene *scene, PrimaryHit *hit, Reservoir *out, Sampler *sampler) {
+    reservoir_clear(out);
+    if (!hit->valid) {
+        return;
+    }
+    for (int i = 0; i < RESAMPLE_CANDIDATES; i++) {
+        sampler_set_dimension(sampler, RESAMPLE_CANDIDATE_DIMENSION + 3 * i);
+        Vec3 light_point, light_normal;
+        float probability;
+        int light = sample_light(&scene->lights, scene->triangles, &hit->point, &hit->normal, &light_point,
+                                 &light_normal, &probability, sampler);
+        if (light == -1) {
+            out->M++;
+            continue;
+        }
+        float area = triangle_area(scene->triangles, &scene->triangles->triangles[light], NULL);
+        float target = resample_target(scene, hit, light, &light_point);
+        reservoir_update(out, light, &light_point, target * area / probability, 1, sampler);
+    }
+    reservoir_finalize(scene, hit, out);
+}
+
+/* 1 if the hits are on similar enough surfaces to share samples */
+static inline int similar_hits(PrimaryHit *a, PrimaryHit *b) {
+    return b->valid && vec3_dot(&a->normal, &b->normal) > 0.9f && fabsf(a->depth - b->depth) < 0.1f * a->depth;
+}
+
+/* merges the reservoirs of some neighbours of pixel x, y into its own and returns the direct
+light of its hit */
+Vec3 resample_neighbors(Scene *scene, PrimaryHit *hits, Reservoir *candidates,
+                        int width, int height, int x, int y, Sampler *sampler) {
+    Vec3 light = {0, 0, 0};
+    int pixel = y * width + x;
+    PrimaryHit *hit = &hits[pixel];
+    Reservoir merged = candidates[pixel];
+    if (!hit->valid) {
+        return light;
+    }
+    sampler_set_dimension(sampler, RESAMPLE_NEIGHBOR_DIMENSION);
+    merged.w_sum = merged.light >= 0 ? resample_target(scene, hit, merged.light, &merged.light_point) * merged.W * merged.M : 0;
+    for (int i = 0; i < RESAMPLE_NEIGHBORS; i++) {
+        Vec2 offset = sample_2d(sampler);
+        int nx = x + (int)((offset.x * 2 - 1) * RESAMPLE_RADIUS);
+        int ny = y + (int)((offset.y * 2 - 1) * RESAMPLE_RADIUS);
+        if (nx < 0 || ny < 0 || nx >= width || ny >= height || (nx == x && ny == y)) {
+            continue;
+        }
+        int neighbor = ny * width + nx;
+        Reservoir *r = &candidates[neighbor];
+        if (r->light < 0 || !similar_hits(hit, &hits[neighbor])) {
+            continue;
+        }
+        float target = resample_target(scene, hit, r->light, &r->light_point);
+        reservoir_update(&merged, r->light, &r->light_point, target * r->W * r->M, r->M, sampler);
+    }
+    reservoir_finalize(scene, hit, &merged);
+    if (merged.W > 0 && light_visible(scene, hit, merged.light, &merged.light_point)) {
+        float target = resample_target(scene, hit, merged.light, &merged.light_point);
+        vec3_scale(&hit->throughput, target * merged.W / M_PI, &light);
+    }
+    return light;
+}
+
+#endif // RESERVOIRS_H
@@ -0,0 +1,142 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+#include <stdint.h>
+#include "linalg.h"
+
+/* the random numbers of a sample, indexed by pixel, sample and dimension. The dimensions
+are handed out in order, trace sets the first dimension of every bounce so a dimension
+keeps its meaning between the samples of a pixel. Every sample_1d and sample_2d takes
+one dimension.
+
+SAMPLER_SOBOL: Owen scrambled Sobol points (Burley 2020). Every dimension uses the first
+two Sobol dimensions with its own shuffling and scrambling, so the samples of a pixel are
+stratified in every pair of numbers that belong together.
+SAMPLER_BLUE_NOISE: the same scrambled Sobol points for all pixels, shifted per pixel
+and dimension by interleaved gradient noise (Jimenez 2014), as in blue noise dithered
+sampling (Georgiev and Fajardo 2016). The error of neighbouring pixels differs, so it
+looks like fine noise at low sample counts instead of clumps.
+SAMPLER_RANDOM: independent numbers, for reference */
+enum {
+    SAMPLER_RANDOM,
+    SAMPLER_SOBOL,
+    SAMPLER_BLUE_NOISE,
+};
+
+typedef struct {
+    int type;           // SAMPLER_*
+    int x, y;           // pixel
+    uint32_t index;     // of the sample in the pixel
+    uint32_t seed;      // scrambles the sequence, of the pixel for SAMPLER_SOBOL
+    uint32_t dimension; // handed out next
+    Rng rng;            // numbers of SAMPLER_RANDOM, reseeded per dimension set
+} Sampler;
+
+static inline uint32_t reverse_bits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+/* Owen scrambling of the bits of x, every bit is flipped depending on the bits above it */
+static inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    x = reverse_bits(x);
+    x += seed; // Laine-Karras permutation with the constants of Burley 2020
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+/* second Sobol dimension, the first is reverse_bits(index) */
+static inline uint32_t sobol_dim1(uint32_t index) {
+    uint32_t result = 0;
+    for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+        if (index & 1) {
+            result ^= v;
+        }
+    }
+    return result;
+}
+
+static inline float bits_to_float(uint32_t x) {
+    return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+/* interleaved gradient noise in [0, 1) */
+static inline float gradient_noise(float x, float y) {
+    float f = 0.06711056f * x + 0.00583715f * y;
+    f = 52.9829189f * (f - floorf(f));
+    return f - floorf(f);
+}
+
+static inline uint32_t gradient_noise_bits(Sampler *s, uint32_t dimension, int component) {
+    // every dimension and component looks at the noise from another offset
+    float shift = 5.588238f * (float)(2 * dimension + component);
+    return (uint32_t)(gradient_noise(s->x + shift, s->y + shift) * 4294967296.0);
+}
+
+static inline void sampler_set_dimension(Sampler *s, uint32_t dimension) {
+    s->dimension = dimension;
+    if (s->type == SAMPLER_RANDOM) {
+        s->rng = rng_seed(s->seed, ((uint64_t)s->index << 32) | dimension);
+    }
+}
+
+/* sampler for sample index of pixel x, y */
+static inline Sampler make_sampler(int type, uint64_t seed, int x, int y, uint32_t index) {
+    Sampler s;
+    s.type = type;
+    s.x = x;
+    s.y = y;
+    s.index = index;
+    if (type != SAMPLER_BLUE_NOISE) {
+        seed ^= hash64(((uint64_t)(uint32_t)y << 32) | (uint32_t)x);
+    }
+    s.seed = (uint32_t)hash64(seed);
+    sampler_set_dimension(&s, 0);
+    return s;
+}
+
+/* the next two dimensions as fixed point numbers */
+static inline void sample_bits(Sampler *s, uint32_t *u, uint32_t *v) {
+    uint32_t dimension = s->dimension++;
+    switch (s->type) {
+    case SAMPLER_SOBOL:
+    case SAMPLER_BLUE_NOISE: {
+        uint32_t seed = (uint32_t)hash64(((uint64_t)s->seed << 32) | dimension);
+        uint32_t index = nested_uniform_scramble(s->index, seed);
+        *u = nested_uniform_scramble(reverse_bits(index), seed ^ 0xa511e9b3u);
+        *v = nested_uniform_scramble(sobol_dim1(index), seed ^ 0x63d83595u);
+        if (s->type == SAMPLER_BLUE_NOISE) { // shifted around the unit square
+            *u += gradient_noise_bits(s, dimension, 0);
+            *v += gradient_noise_bits(s, dimension, 1);
+        }
+        break;
+    }
+    default:
+        *u = rng_next(&s->rng);
+        *v = rng_next(&s->rng);
+        break;
+    }
+}
+
+/* uniform in [0, 1) */
+static inline float sample_1d(Sampler *s) {
+    uint32_t u, v;
+    sample_bits(s, &u, &v);
+    return bits_to_float(u);
+}
+
+/* uniform in [0, 1)^2 */
+static inline Vec2 sample_2d(Sampler *s) {
+    uint32_t u, v;
+    sample_bits(s, &u, &v);
+    Vec2 result = {bits_to_float(u), bits_to_float(v)};
+    return result;
+}
+
+#endif // SAMPLER_H
@@ -2,6 +2,7 @@
 #define SPATIAL_H
 #include "mesh.h"
 #include "materials.h"
+#include "lights.h"
 #include <math.h>
 
 typedef struct {
@@ -40,6 +41,7 @@ typedef struct {
     Voxel *voxels; // cells
     Box bbox;
     Materials materials;
+    Lights lights; // emissive triangles for next event estimation
 } Scene;
 
 int getVoxelIndex(Scene *scene, int x, int y, int z){
@@ -59,6 +61,7 @@ void freeScene(Scene *scene){
     free_triangles(scene->triangles);
     free(scene->voxels);
     free_materials(scene->materials);
+    free_lights(&scene->lights);
 }
 
 void point2floor(Vec3 *p, float boxsize){
@@ -84,12 +87,12 @@ Vec3Int point2voxel(Scene *scene, Vec3 *point){
     return coor;
 }
 
-Box get_bbox(Triangle *t){
+Box get_bbox(Triangles *mesh, Triangle *t){
     Vec3 min_p;
     Vec3 max_p;
-    vec3_copy(&t->v1, &min_p);
-    vec3_copy(&t->v1, &max_p);
-    Vec3 vertices[3] = {t->v2, t->v3};
+    vec3_copy(&mesh->positions[t->v[0]], &min_p);
+    vec3_copy(&mesh->positions[t->v[0]], &max_p);
+    Vec3 vertices[2] = {mesh->positions[t->v[1]], mesh->positions[t->v[2]]};
     for (int j = 0; j < 2; j++) {
         Vec3 v = vertices[j];
         // Update min coordinates
@@ -111,29 +114,25 @@ Box get_bbox(Triangle *t){
 void buildScene(Camera *cam, Triangles *trias, Scene *scene, int desired_boxes, Materials mats){
     scene->materials = mats;
     scene->triangles = trias;
+    scene->lights = build_lights(trias, &scene->materials);
     int trias_per_voxel = 0;
     // calculate total bounding box first:
     vec3_copy( &cam->position, &scene->bbox.p1);
     vec3_copy( &cam->position, &scene->bbox.p2);
 
-    for (int i = 0; i < trias->count; i++) {
-        Triangle t = trias->triangles[i];
-
-        // Check each vertex of the triangle
-        Vec3 vertices[3] = {t.v1, t.v2, t.v3};
-        for (int j = 0; j < 3; j++) {
-            Vec3 v = vertices[j];
+    // every welded vertex is referenced by at least one triangle
+    for (int i = 0; i < trias->vertex_count; i++) {
+        Vec3 v = trias->positions[i];
 
-            // Update min coordinates
-            if (v.x < scene->bbox.p1.x) scene->bbox.p1.x = v.x;
-            if (v.y < scene->bbox.p1.y) scene->bbox.p1.y = v.y;
-            if (v.z < scene->bbox.p1.z) scene->bbox.p1.z = v.z;
+        // Update min coordinates
+        if (v.x < scene->bbox.p1.x) scene->bbox.p1.x = v.x;
+        if (v.y < scene->bbox.p1.y) scene->bbox.p1.y = v.y;
+        if (v.z < scene->bbox.p1.z) scene->bbox.p1.z = v.z;
 
-            // Update max coordinates
-            if (v.x > scene->bbox.p2.x) scene->bbox.p2.x = v.x;
-            if (v.y > scene->bbox.p2.y) scene->bbox.p2.y = v.y;
-            if (v.z > scene->bbox.p2.z) scene->bbox.p2.z = v.z;
-        }
+        // Update max coordinates
+        if (v.x > scene->bbox.p2.x) scene->bbox.p2.x = v.x;
+        if (v.y > scene->bbox.p2.y) scene->bbox.p2.y = v.y;
+        if (v.z > scene->bbox.p2.z) scene->bbox.p2.z = v.z;
     }
     // snap bounding box to grid:
     scene->boxsize = (scene->bbox.p2.x - scene->bbox.p1.x)/desired_boxes;
@@ -161,10 +160,14 @@ void buildScene(Camera *cam, Triangles *trias, Scene *scene, int desired_boxes,
         }
     }
     for (int i = 0; i < trias->count; i++) {
-        Triangle t = trias->triangles[i];
-        Box bbox = get_bbox(&t);
+        Triangle *t = &trias->triangles[i];
+        Box bbox = get_bbox(trias, t);
         Vec3Int coor_1 = point2voxel(scene, &bbox.p1);
         Vec3Int coor_2 = point2voxel(scene, &bbox.p2);
+        // triangles on the max faces of the grid go into its last cells, not past them
+        coor_1.x = max(coor_1.x, 0); coor_2.x = min(coor_2.x, scene->numboxes.x - 1);
+        coor_1.y = max(coor_1.y, 0); coor_2.y = min(coor_2.y, scene->numboxes.y - 1);
+        coor_1.z = max(coor_1.z, 0); coor_2.z = min(coor_2.z, scene->numboxes.z - 1);
         for (int x_i = coor_1.x; x_i <= coor_2.x; x_i++){
             for (int y_i = coor_1.y; y_i <= coor_2.y; y_i++){
                 for (int z_i = coor_1.z; z_i <= coor_2.z; z_i++){
@@ -173,7 +176,7 @@ void buildScene(Camera *cam, Triangles *trias, Scene *scene, int desired_boxes,
                         scene->bbox.p1.y + y_i * scene->boxsize,
                         scene->bbox.p1.z + z_i * scene->boxsize
                     };
-                    if (triangle_intersects_voxel_heuristic(&t, &voxel_min, scene->boxsize)) {
+                    if (triangle_intersects_voxel_heuristic(trias, t, &voxel_min, scene->boxsize)) {
                         trias_per_voxel ++;
                         int arr_ind = getVoxelIndex(scene, x_i, y_i, z_i);
                         Voxel *vox = &scene->voxels[arr_ind];
@@ -208,13 +211,15 @@ int isInGrid(Scene *scene, Vec3Int *cell){
     return 1;
 }
 
-int handleVoxel(Scene *scene, Voxel *vox, Ray *r, Vec3 *barycentric){
+HOT_KERNEL int handleVoxel(Scene *scene, Voxel *vox, Ray *r, Vec3 *barycentric){
     float min_t = 1e10;
     int tria_ind = -1;
     Vec3 out_temp;
+    Vec3 *positions = scene->triangles->positions;
     for (int i = 0; i < vox->trias_count; i++){
         int t_ind = vox->trias[i];
-        if (ray_intersects_triangle(r, &scene->triangles->triangles[t_ind], &out_temp)){
+        int *v = scene->triangles->triangles[t_ind].v;
+        if (ray_intersects_triangle(r, &positions[v[0]], &positions[v[1]], &positions[v[2]], &out_temp)){
             if (out_temp.x < min_t){
                 tria_ind = t_ind;
                 vec3_copy(&out_temp, barycentric);
@@ -226,7 +231,7 @@ int handleVoxel(Scene *scene, Voxel *vox, Ray *r, Vec3 *barycentric){
 }
 
 /*casts a ray into the scene. Returns the index of the triangle it intersects.*/
-int castRay(Ray *ray_inpt, Scene *scene, Vec3 *barycentric){
+HOT_KERNEL int castRay(Ray *ray_inpt, Scene *scene, Vec3 *barycentric){
     Ray r;
     vec3_copy(&ray_inpt->origin, &r.origin);
     vec3_copy(&ray_inpt->direction, &r.direction);
@@ -270,7 +275,7 @@ int castRay(Ray *ray_inpt, Scene *scene, Vec3 *barycentric){
         if (this_res != -1 && curr_barycentric.x < best_t){
             // small improvement.
             float max_v = -INFINITY;
-            Box tria_bbox = get_bbox(&scene->triangles->triangles[this_res]);
+            Box tria_bbox = get_bbox(scene->triangles, &scene->triangles->triangles[this_res]);
             Vec3 lengths_vec; vec3_subtract(&tria_bbox.p2, &tria_bbox.p1, &lengths_vec);
             float *lengths = (float *)&lengths_vec;
             for (size_t i = 0; i < 3; i++)
@@ -0,0 +1,219 @@
+#ifndef TEXTURECACHE_H
+#define TEXTURECACHE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <omp.h>
+
+/* demand paged texels. Textures of a binary scene can be left on disk and read in pages
+of TEX_PAGE_SIZE bytes into a fixed pool of frames when they are first sampled. When the
+pool is full a clock sweep (an approximation of least recently used) picks the frame to
+reuse. Pages hold whole tiles and blocks, so a texel never spans two pages.
+
+Threads sample without locking: they pin the frame their page table points to and check
+that it still holds their page. Loading and evicting happen under the cache lock, and a
+frame is only reused when nobody has it pinned */
+#define TEX_PAGE_SHIFT 16
+#define TEX_PAGE_SIZE (1 << TEX_PAGE_SHIFT)
+
+/* texels of one texture in a file */
+typedef struct {
+    int fd;
+    uint64_t offset;     // of the texels in the file
+    uint64_t size;       // in bytes
+    int id;              // unique, part of the frame owner keys
+    int page_count;
+    atomic_int *frames;  // frame holding each page, -1 if it is not loaded
+} PagedTexels;
+
+typedef struct {
+    char *data;
+    atomic_int pins;          // threads reading from the frame right now
+    atomic_int referenced;    // sampled since the clock hand passed it last
+    atomic_llong owner;       // texture id << 32 | page, -1 while free or being replaced
+    PagedTexels *owner_texels; // only touched under the lock
+    int owner_page;
+} PageFrame;
+
+typedef struct {
+    PageFrame *frames;
+    int frame_count;     // 0 if paging is disabled
+    int hand;            // clock hand
+    int next_id;
+    omp_lock_t lock;
+    atomic_long loads;   // pages read from disk
+} PageCache;
+
+static PageCache page_cache;
+
+/* enables paging with about budget bytes of frames. Every thread can pin a frame, so
+there are always a few more frames than threads */
+void init_page_cache(size_t budget) {
+    int min_frames = omp_get_max_threads() * 2 + 1;
+    page_cache.frame_count = (int)(budget / TEX_PAGE_SIZE);
+    if (page_cache.frame_count < min_frames) {
+        page_cache.frame_count = min_frames;
+    }
+    page_cache.frames = calloc(page_cache.frame_count, sizeof(PageFrame));
+    char *data = malloc((size_t)page_cache.frame_count * TEX_PAGE_SIZE);
+    if (!page_cache.frames || !data) {
+        fprintf(stderr, "Error: Memory allocation failed for the texture cache\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < page_cache.frame_count; i++) {
+        PageFrame *frame = &page_cache.frames[i];
+        frame->data = data + (size_t)i * TEX_PAGE_SIZE;
+        atomic_init(&frame->pins, 0);
+        atomic_init(&frame->referenced, 0);
+        atomic_init(&frame->owner, -1);
+    }
+    page_cache.hand = 0;
+    atomic_init(&page_cache.loads, 0);
+    omp_init_lock(&page_cache.lock);
+    printf("Paging textures through a %d MB cache\n", (int)((size_t)page_cache.frame_count * TEX_PAGE_SIZE >> 20));
+}
+
+void free_page_cache(void) {
+    if (page_cache.frame_count == 0) {
+        return;
+    }
+    printf("Texture cache: %ld pages loaded\n", (long)atomic_load(&page_cache.loads));
+    free(page_cache.frames[0].data);
+    free(page_cache.frames);
+    omp_destroy_lock(&page_cache.lock);
+    page_cache.frames = NULL;
+    page_cache.frame_count = 0;
+}
+
+/* registers size bytes at offset of filename for paging. Returns NULL if the file can not be opened */
+PagedTexels *page_texels(const char *filename, uint64_t offset, uint64_t size) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    PagedTexels *texels = malloc(sizeof(PagedTexels));
+    texels->fd = fd;
+    texels->offset = offset;
+    texels->size = size;
+    texels->page_count = (int)((size + TEX_PAGE_SIZE - 1) >> TEX_PAGE_SHIFT);
+    texels->frames = malloc((texels->page_count + 1) * sizeof(atomic_int));
+    for (int i = 0; i < texels->page_count; i++) {
+        atomic_init(&texels->frames[i], -1);
+    }
+    omp_set_lock(&page_cache.lock);
+    texels->id = page_cache.next_id++;
+    omp_unset_lock(&page_cache.lock);
+    return texels;
+}
+
+/* frees the frames of the texels and closes the file, nobody may sample them anymore */
+void free_paged_texels(PagedTexels *texels) {
+    omp_set_lock(&page_cache.lock);
+    for (int i = 0; i < page_cache.frame_count; i++) {
+        PageFrame *frame = &page_cache.frames[i];
+        if (frame->owner_texels == texels) {
+            frame->owner_texels = NULL;
+            atomic_store(&frame->owner, -1);
+        }
+    }
+    omp_unset_lock(&page_cache.lock);
+    close(texels->fd);
+    free(texels->frames);
+    free(texels);
+}
+
+static inline long long page_key(PagedTexels *texels, int page) {
+    return ((long long)texels->id << 32) | page;
+}
+
+/* picks a frame nobody has pinned or sampled recently and detaches it from its page.
+Called with the lock held */
+PageFrame *evict_frame(void) {
+    while (1) {
+        PageFrame *frame = &page_cache.frames[page_cache.hand];
+        page_cache.hand = (page_cache.hand + 1) % page_cache.frame_count;
+        if (atomic_exchange(&frame->referenced, 0)) {
+            continue; // second chance
+        }
+        long long old = atomic_exchange(&frame->owner, -1);
+        if (atomic_load(&frame->pins) > 0) { // somebody pinned it before the owner changed
+            atomic_store(&frame->owner, old);
+            continue;
+        }
+        if (frame->owner_texels) {
+            atomic_store(&frame->owner_texels->frames[frame->owner_page], -1);
+            frame->owner_texels = NULL;
+        }
+        return frame;
+    }
+}
+
+/* slow path of pin_texels: loads the page into a frame unless another thread just did */
+PageFrame *load_page(PagedTexels *texels, int page) {
+    long long key = page_key(texels, page);
+    omp_set_lock(&page_cache.lock);
+    int f = atomic_load(&texels->frames[page]);
+    PageFrame *frame = f >= 0 ? &page_cache.frames[f] : NULL;
+    if (frame) {
+        atomic_fetch_add(&frame->pins, 1);
+    } else {
+        frame = evict_frame();
+        uint64_t start = (uint64_t)page << TEX_PAGE_SHIFT;
+        size_t size = texels->size - start < TEX_PAGE_SIZE ? texels->size - start : TEX_PAGE_SIZE;
+        size_t done = 0;
+        while (done < size) {
+            ssize_t n = pread(texels->fd, frame->data + done, size - done, texels->offset + start + done);
+            if (n <= 0) {
+                perror("Error reading texture page");
+                exit(EXIT_FAILURE);
+            }
+            done += n;
+        }
+        atomic_fetch_add(&page_cache.loads, 1);
+        frame->owner_texels = texels;
+        frame->owner_page = page;
+        // threads that read a stale index may hold speculative pins on the frame until they
+        // see the owner, adding keeps them from being wiped out with the count
+        atomic_fetch_add(&frame->pins, 1);
+        atomic_store(&frame->owner, key);
+        atomic_store(&texels->frames[page], (int)(frame - page_cache.frames));
+    }
+    atomic_store_explicit(&frame->referenced, 1, memory_order_relaxed);
+    omp_unset_lock(&page_cache.lock);
+    return frame;
+}
+
+/* returns the address of byte offset of the texels and pins its frame, which has to be
+passed to unpin_texels once the texel is read */
+static inline const char *pin_texels(PagedTexels *texels, size_t offset, PageFrame **pinned) {
+    int page = (int)(offset >> TEX_PAGE_SHIFT);
+    int f = atomic_load_explicit(&texels->frames[page], memory_order_relaxed);
+    PageFrame *frame = NULL;
+    if (f >= 0) {
+        frame = &page_cache.frames[f];
+        atomic_fetch_add(&frame->pins, 1);
+        if (atomic_load(&frame->owner) == page_key(texels, page)) {
+            if (!atomic_load_explicit(&frame->referenced, memory_order_relaxed)) {
+                atomic_store_explicit(&frame->referenced, 1, memory_order_relaxed);
+            }
+        } else { // evicted in the meantime
+            atomic_fetch_sub(&frame->pins, 1);
+            frame = NULL;
+        }
+    }
+    if (!frame) {
+        frame = load_page(texels, page);
+    }
+    *pinned = frame;
+    return frame->data + (offset & (TEX_PAGE_SIZE - 1));
+}
+
+static inline void unpin_texels(PageFrame *frame) {
+    atomic_fetch_sub_explicit(&frame->pins, 1, memory_order_release);
+}
+
+#endif // TEXTURECACHE_H
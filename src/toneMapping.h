@@ -26,6 +26,35 @@ Vec3 reinhard_extended_luminance(Vec3 v, float max_white_l)
     return change_luminance(v, l_new);
 }
 
+/* tonemaps the accumulated radiance into 8 bit rgb, samples holds the number of samples
+summed up in every pixel */
+HOT_KERNEL void tonemap_image(float *image_buff, unsigned char *image, int pixel_count, const int *samples){
+    float max_v = 0;
+    for (int i = 0; i < pixel_count*3; i++) {
+        // the white point is the brightest mean, the sums grow with the samples of the pixel
+        float v = samples[i / 3] > 0 ? image_buff[i]/samples[i / 3] : 0;
+        if (v > max_v){
+            max_v = v;
+        }
+    }
+    for (int i = 0; i < pixel_count; i++) {
+        Vec3 c = {0, 0, 0};
+        if (samples[i] > 0) {
+            c.x = image_buff[i * 3]/samples[i];
+            c.y = image_buff[i * 3 + 1]/samples[i];
+            c.z = image_buff[i * 3 + 2]/samples[i];
+            c = reinhard_extended_luminance(c, max_v);
+        }
+        if (c.x > 1){ c.x = 1; }
+        if (c.y > 1){ c.y = 1; }
+        if (c.z > 1){ c.z = 1; }
+
+        image[i * 3] = (unsigned char)(c.x*255);
+        image[i * 3 + 1] = (unsigned char)(c.y*255);
+        image[i * 3 + 2] = (unsigned char)(c.z*255);
+    }
+}
+
 Vec3 reinhard(Vec3 v){
     Vec3 res;
     res.x = v.x + 1;
@@ -1,53 +1,217 @@
 #ifndef TRACER_H
 #define TRACER_H
 #include "spatial.h"
+#include "reservoirs.h"
 
-Vec3 trace(Scene *scene, Ray *cam_ray, int bounces){
+/* cone spread a bounce adds, a rough estimate of the lobe width of a diffuse bounce */
+#define CONE_DIFFUSE_SPREAD 0.5f
+
+/* bounces every path makes before russian roulette may end it */
+#define ROULETTE_MIN_BOUNCES 3
+/* highest chance of a path to survive russian roulette, so bright paths end eventually too */
+#define ROULETTE_MAX_SURVIVAL 0.95f
+
+/* sampler dimensions of a path: the camera takes the first ones, then every bounce gets
+the same number, for shade_hit (up to 4), the light sample (2) and russian roulette (1) */
+#define SAMPLER_CAMERA_DIMENSIONS 2
+#define SAMPLER_BOUNCE_DIMENSIONS 8
+#define SAMPLER_LIGHT_DIMENSION 4 // of a bounce
+#define SAMPLER_ROULETTE_DIMENSION 6
+
+/* counts of one thread, summed up for the report at the end */
+typedef struct {
+    long long paths;
+    long long segments;   // rays cast along the paths, without shadow rays
+    long long roulette;   // paths ended by russian roulette
+} PathStats;
+
+/* what shade_hit found */
+enum {
+    HIT_LIGHT,    // the path ends on an emitter
+    HIT_DIFFUSE,  // new_dir was sampled from the cosine weighted diffuse lobe
+    HIT_GLOSSY,   // new_dir was sampled from the GGX reflection lobe
+    HIT_ABSORBED, // the sampled reflection points into the surface, the path ends dark
+};
+
+/* shades a hit of a material whose flags are covered by flags. Returns HIT_LIGHT with
+the emission if the path ends there, otherwise multiplies res with the surface color and
+sets new_dir and the shading normal. Always inlined with a constant flags, so every shading class gets a copy
+without the branches and fetches it does not need, see SHADING_CLASSES */
+static inline __attribute__((always_inline)) int shade_hit(const int flags, Triangles *mesh, Triangle *this_tria,
+        Material *this_mat, Vec3 *barycentric, Ray *curr_ray, Vec3 *res, float *emission, float *cone_width,
+        float *cone_spread, Vec3 *new_dir, Vec3 *tria_normal, Sampler *sampler) {
+    if (flags & MAT_EMISSIVE) { // if it is light, return:
+        *emission = this_mat->emissive.value.x;
+        return HIT_LIGHT;
+    }
+    Vec2 uv = {0, 0};
+    float lod = 0;
+    GetTriangleNormal(mesh, this_tria, barycentric, tria_normal);
+    float cos_in = vec3_dot(&curr_ray->direction, tria_normal);
+    *cone_width += *cone_spread * barycentric->x;
+    if (flags & MAT_TEXTURED) {
+        GetTriangleUV(mesh, this_tria, barycentric, &uv);
+        lod = GetTriangleLOD(mesh, this_tria, *cone_width, cos_in);
+        lod += sample_1d(sampler); // stochastic choice between the two nearest levels
+    }
+    if (flags & MAT_EMISSIVE_TEXTURE) {
+        float emissive = get_prop_val(&this_mat->emissive, &uv, lod).x;
+        if (emissive > 0) {
+            *emission = emissive;
+            return HIT_LIGHT;
+        }
+    }
+    float fresnel = 0, metallic = 0;
+    if (flags & MAT_SPECULAR) {
+        float spec_ior = get_prop_val(&this_mat->specular, &uv, lod).x;
+        fresnel = fresnel_dielectric_cos(cos_in, 1+spec_ior);
+    }
+    if (flags & MAT_METALLIC) {
+        metallic = get_prop_val(&this_mat->metallic, &uv, lod).x;
+    }
+
+    // reflection and diffuse:
+    // TODO: apply normal map here
+    if (!(flags & (MAT_SPECULAR | MAT_METALLIC))) { // pure diffuse
+        Vec3 base_color = get_prop_val(&this_mat->color, &uv, lod);
+        vec3_mul(res, &base_color, res);
+        Vec2 u = sample_2d(sampler);
+        *new_dir = rand_lambertian(tria_normal, &u);
+        *cone_spread += CONE_DIFFUSE_SPREAD;
+        return HIT_DIFFUSE;
+    }
+    // apply materials:
+    int glossy = 0;
+    if (fresnel > 0 && sample_1d(sampler) < fresnel){ // make it specular ray:
+        Vec3 spec_color = get_prop_val(&this_mat->specular_color, &uv, lod);
+        vec3_mul(res, &spec_color, res); // apply specular color
+        glossy = 1;
+    }
+    else{
+        Vec3 base_color = get_prop_val(&this_mat->color, &uv, lod);
+        vec3_mul(res, &base_color, res); // apply the base color
+    }
+    if (metallic > 0 && sample_1d(sampler) < metallic){ // make it metallic ray:
+        glossy = 1;
+    }
+    Vec2 u = sample_2d(sampler);
+    if (!glossy) {
+        *new_dir = rand_lambertian(tria_normal, &u);
+        *cone_spread += CONE_DIFFUSE_SPREAD;
+        return HIT_DIFFUSE;
+    }
+    float roughness = get_prop_val(&this_mat->specular_roughness, &uv, lod).x;
+    float weight = sample_ggx(&curr_ray->direction, tria_normal, roughness * roughness, &u, new_dir);
+    if (weight <= 0) {
+        return HIT_ABSORBED;
+    }
+    vec3_scale(res, weight, res);
+    *cone_spread += roughness * CONE_DIFFUSE_SPREAD;
+    return HIT_GLOSSY;
+}
+
+/* next event estimation at a diffuse hit: light arriving at point straight from a
+sampled light, weighted by res and the diffuse lobe and against finding the same light
+with the bounce (power heuristic). Returns 0 if the light is hidden or behind */
+static inline Vec3 sample_direct_light(Scene *scene, Vec3 *point, Vec3 *normal, Vec3 *res, Sampler *sampler) {
+    Vec3 contribution = {0, 0, 0};
+    Vec3 light_point, light_normal, to_light;
+    float probability;
+    int light = sample_light(&scene->lights, scene->triangles, point, normal, &light_point, &light_normal,
+                             &probability, sampler);
+    if (light == -1) {
+        return contribution;
+    }
+    vec3_subtract(&light_point, point, &to_light);
+    float dist = vec3_magnitude(&to_light);
+    if (dist <= 0) {
+        return contribution;
+    }
+    Ray shadow_ray = {*point, to_light};
+    vec3_scale(&shadow_ray.direction, 1 / dist, &shadow_ray.direction);
+    float cos_surface = vec3_dot(normal, &shadow_ray.direction);
+    if (cos_surface <= 0) {
+        return contribution;
+    }
+    Vec3 barycentric;
+    int blocker = castRay(&shadow_ray, scene, &barycentric);
+    if (blocker != light && (blocker == -1 || barycentric.x < dist * (1 - 1e-3f))) {
+        return contribution; // something is in between
+    }
+    Triangle *light_tria = &scene->triangles->triangles[light];
+    float emission = scene->materials.mats[light_tria->material].emissive.value.x;
+    float light_pdf_val = light_pdf(probability, triangle_area(scene->triangles, light_tria, NULL), dist,
+                                    vec3_dot(&shadow_ray.direction, &light_normal));
+    float bsdf_pdf = cos_surface / M_PI;
+    float weight = power_heuristic(light_pdf_val, bsdf_pdf);
+    vec3_scale(res, emission * bsdf_pdf / light_pdf_val * weight, &contribution);
+    return contribution;
+}
+
+/* pixel_spread is the initial spread angle of the ray cone that selects the texture
+levels, see camera_pixel_spread. If primary is given, the direct light of the first
+diffuse hit is left out and the hit is recorded for resample_candidates instead.
+After ROULETTE_MIN_BOUNCES a path goes on with a chance that follows its throughput,
+and the paths that survive are weighted up by it, so bounces is only an upper limit */
+HOT_KERNEL Vec3 trace(Scene *scene, Ray *cam_ray, int bounces, float pixel_spread, PrimaryHit *primary,
+                      PathStats *stats, Sampler *sampler){
     Ray curr_ray;
     vec3_copy(&cam_ray->origin, &curr_ray.origin);
     vec3_copy(&cam_ray->direction, &curr_ray.direction);
-    Vec3 res;
+    Vec3 res; // throughput of the path so far
     res.x = 1; res.y = 1; res.z = 1;
+    Vec3 radiance = {0, 0, 0};
+    float cone_width = 0;
+    float cone_spread = pixel_spread;
+    float bounce_pdf = 0; // pdf of the last diffuse bounce if a light sample competed with it, else 0
+    Vec3 bounce_normal;   // of the surface it left
+    int resampled = 0;    // 1 if the last bounce left the recorded primary hit, its lights are already counted
+    if (primary) {
+        primary->valid = 0;
+    }
+    stats->paths++;
     for (int bounce = 0; bounce < bounces; bounce++)
     {
         Vec3 barycentric;
+        uint32_t dimension = SAMPLER_CAMERA_DIMENSIONS + bounce * SAMPLER_BOUNCE_DIMENSIONS;
+        sampler_set_dimension(sampler, dimension);
+        stats->segments++;
         int tria_ind = castRay(&curr_ray, scene, &barycentric);
         if (tria_ind != -1) { // intersection found!
-            Triangle *this_tria = &scene->triangles->triangles[tria_ind];
-            
-            // read material properties:
-            Material *this_mat = this_tria->material;
-            Vec3 base_color = get_prop_val(&this_mat->color, this_tria, &barycentric);
-            Vec3 spec_color = get_prop_val(&this_mat->specular_color, this_tria, &barycentric);
-            float spec_ior = get_prop_val(&this_mat->specular, this_tria, &barycentric).x;
-            float emissive = get_prop_val(&this_mat->emissive, this_tria, &barycentric).x;
-            float metallic = get_prop_val(&this_mat->metallic, this_tria, &barycentric).x;
-            float roughness = get_prop_val(&this_mat->specular_roughness, this_tria, &barycentric).x;
-            // if it is light, return: 
-            if (emissive > 0){
-                vec3_scale(&res, emissive, &res);
-                return res;
-            }
+            Triangles *mesh = scene->triangles;
+            Triangle *this_tria = &mesh->triangles[tria_ind];
             
-            // reflection and diffuse:
-            Vec3 tria_normal;
-            GetTriangleNormal(this_tria, &barycentric, &tria_normal);
-            // TODO: apply normal map here
-            Vec3 new_dir = rand_lambertian(&tria_normal);
-            Vec3 out_reflect; 
-            reflect(&curr_ray, this_tria, &tria_normal, &out_reflect);
-            vec3_lerp(&out_reflect, &new_dir, roughness, &out_reflect); // apply roughness
-            float fresnel = fresnel_dielectric_cos(vec3_dot(&curr_ray.direction, &tria_normal), 1+spec_ior);
-            // apply materials:
-            if (randFloat() < fresnel){ // make it specular ray:
-                vec3_mul(&res, &spec_color, &res); // apply specular color
-                vec3_copy(&out_reflect, &new_dir);
+            Material *this_mat = &scene->materials.mats[this_tria->material];
+            Vec3 new_dir, tria_normal;
+            float emission = 0;
+            int hit = HIT_LIGHT;
+            switch (this_mat->shading) { // one shading kernel per class
+#define SHADING_CASE(name, flags) \
+            case name: \
+                hit = shade_hit(flags, mesh, this_tria, this_mat, &barycentric, &curr_ray, &res, &emission, \
+                                &cone_width, &cone_spread, &new_dir, &tria_normal, sampler); \
+                break;
+            SHADING_CLASSES(SHADING_CASE)
+#undef SHADING_CASE
             }
-            else{
-                vec3_mul(&res, &base_color, &res); // apply the base color
+            if (hit == HIT_LIGHT) {
+                float weight = 1;
+                LightRef *light = bounce_pdf > 0 || resampled ? find_light(&scene->lights, tria_ind) : NULL;
+                if (light && resampled) {
+                    weight = 0;
+                } else if (light) { // the light sample could have found it too
+                    Vec3 light_normal;
+                    float area = triangle_area(mesh, this_tria, &light_normal);
+                    float probability = light_probability(&scene->lights, light, &curr_ray.origin, &bounce_normal);
+                    float pdf = light_pdf(probability, area, barycentric.x, vec3_dot(&curr_ray.direction, &light_normal));
+                    weight = power_heuristic(bounce_pdf, pdf);
+                }
+                vec3_scale(&res, emission * weight, &res);
+                vec3_add(&radiance, &res, &radiance);
+                return radiance;
             }
-            if (randFloat() < metallic){ // make it metallic ray:
-                vec3_copy(&out_reflect, &new_dir);
+            if (hit == HIT_ABSORBED) {
+                break;
             }
 
             // calc new ray:
@@ -55,13 +219,39 @@ Vec3 trace(Scene *scene, Ray *cam_ray, int bounces){
             vec3_scale(&dir_scaled, barycentric.x, &dir_scaled);
             vec3_add(&curr_ray.origin, &dir_scaled, &curr_ray.origin);
             vec3_copy(&new_dir, &curr_ray.direction);
+
+            // sample a light, unless the path ends here anyway:
+            bounce_pdf = 0;
+            resampled = 0;
+            if (hit == HIT_DIFFUSE && scene->lights.count > 0 && bounce + 1 < bounces) {
+                if (primary && bounce == 0) { // resampled later, see resample_candidates
+                    *primary = (PrimaryHit){curr_ray.origin, tria_normal, res, barycentric.x, 1};
+                    resampled = 1;
+                } else {
+                    sampler_set_dimension(sampler, dimension + SAMPLER_LIGHT_DIMENSION);
+                    Vec3 direct = sample_direct_light(scene, &curr_ray.origin, &tria_normal, &res, sampler);
+                    vec3_add(&radiance, &direct, &radiance);
+                    bounce_pdf = fmaxf(vec3_dot(&tria_normal, &new_dir), 1e-6f) / M_PI;
+                    bounce_normal = tria_normal;
+                }
+            }
+
+            // russian roulette, after the light of this hit is counted:
+            if (bounce + 1 >= ROULETTE_MIN_BOUNCES && bounce + 1 < bounces) {
+                float survival = fminf(fmaxf(res.x, fmaxf(res.y, res.z)), ROULETTE_MAX_SURVIVAL);
+                sampler_set_dimension(sampler, dimension + SAMPLER_ROULETTE_DIMENSION);
+                if (sample_1d(sampler) >= survival) {
+                    stats->roulette++;
+                    break;
+                }
+                vec3_scale(&res, 1 / survival, &res);
+            }
         }
         else {
             break;
         }
     }
-    vec3_scale(&res, 0.0, &res); // value denotes environment lighting 
-    return res;
+    return radiance; // environment lighting is black
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,86 @@
+/* stress test of the demand paged texture cache: many threads pin the same few pages and
+many cold ones through a pool much smaller than the file, so frames are evicted all the
+time. A pinned frame must keep the page it was pinned for until it is unpinned, every word
+read under a pin is checked against the pattern the file was written with */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <omp.h>
+#include "textureCache.h"
+
+#define THREADS 8
+#define PAGES 64
+#define HOT_PAGES 4     // pinned by all threads at once
+#define ITERATIONS 200000
+#define WORDS_PER_PIN 64 // read under every pin, widens the window for an eviction
+
+static uint32_t pattern(uint64_t offset) {
+    return (uint32_t)(offset * 2654435761u) ^ 0x9e3779b9u;
+}
+
+int main() {
+    char path[] = "/tmp/pageCacheStressXXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        perror("Error creating the test file");
+        return EXIT_FAILURE;
+    }
+    uint64_t size = (uint64_t)PAGES * TEX_PAGE_SIZE;
+    uint32_t *words = malloc(size);
+    for (uint64_t i = 0; i < size / 4; i++) {
+        words[i] = pattern(i * 4);
+    }
+    if (write(fd, words, size) != (ssize_t)size) {
+        perror("Error writing the test file");
+        return EXIT_FAILURE;
+    }
+    free(words);
+    close(fd);
+
+    omp_set_num_threads(THREADS);
+    init_page_cache(0); // the smallest pool, a few frames more than threads
+    PagedTexels *texels = page_texels(path, 0, size);
+    if (!texels) {
+        fprintf(stderr, "Error: Unable to page %s\n", path);
+        return EXIT_FAILURE;
+    }
+
+    long errors = 0;
+    #pragma omp parallel reduction(+:errors)
+    {
+        uint64_t state = 0x853c49e6748fea9bull + omp_get_thread_num();
+        for (int i = 0; i < ITERATIONS; i++) {
+            state = state * 6364136223846793005ull + 1442695040888963407ull;
+            uint32_t r = (uint32_t)(state >> 33);
+            int page = (r & 1) ? (int)((r >> 1) % HOT_PAGES) : (int)((r >> 1) % PAGES);
+            uint64_t word = (r >> 8) % (TEX_PAGE_SIZE / 4 - WORDS_PER_PIN);
+            uint64_t offset = (uint64_t)page * TEX_PAGE_SIZE + word * 4;
+            PageFrame *frame;
+            const uint32_t *data = (const uint32_t *)pin_texels(texels, offset, &frame);
+            for (int k = 0; k < WORDS_PER_PIN; k++) {
+                if (data[k] != pattern(offset + k * 4)) {
+                    errors++;
+                    break;
+                }
+            }
+            unpin_texels(frame);
+        }
+    }
+
+    int pinned = 0;
+    for (int i = 0; i < page_cache.frame_count; i++) {
+        pinned += atomic_load(&page_cache.frames[i].pins) != 0;
+    }
+    printf("%d threads, %d frames for %d pages: %ld reads saw another page, %d frames left pinned\n",
+           THREADS, page_cache.frame_count, PAGES, errors, pinned);
+    free_paged_texels(texels);
+    free_page_cache();
+    unlink(path);
+    if (errors > 0 || pinned > 0) {
+        fprintf(stderr, "Error: page cache stress test failed\n");
+        return EXIT_FAILURE;
+    }
+    printf("page cache stress test passed\n");
+    return EXIT_SUCCESS;
+}
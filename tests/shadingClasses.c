@@ -0,0 +1,61 @@
+/* checks that every combination of material flags gets the first shading class whose
+kernel covers them, and that compile_material picks the classes of simple materials */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "materials.h"
+
+#define CLASS_FLAGS(name, flags) flags,
+static const int class_flags[SHADE_COUNT] = { SHADING_CLASSES(CLASS_FLAGS) };
+#undef CLASS_FLAGS
+
+static int failures = 0;
+
+static void expect(int got, int wanted, const char *what) {
+    if (got != wanted) {
+        fprintf(stderr, "Error: %s gets shading class %d instead of %d\n", what, got, wanted);
+        failures++;
+    }
+}
+
+int main() {
+    expect(shading_class(0), SHADE_DIFFUSE, "flags 0");
+    int all = MAT_TEXTURED | MAT_EMISSIVE_TEXTURE | MAT_SPECULAR | MAT_METALLIC;
+    for (int flags = 0; flags <= all; flags++) {
+        if (flags & ~all) {
+            continue;
+        }
+        int wanted = SHADE_GENERIC;
+        for (int c = 0; c < SHADE_COUNT; c++) {
+            if (c != SHADE_EMISSIVE && (flags & ~class_flags[c]) == 0) {
+                wanted = c;
+                break;
+            }
+        }
+        char what[32];
+        snprintf(what, sizeof(what), "flags %d", flags);
+        expect(shading_class(flags), wanted, what);
+    }
+
+    Material m;
+    memset(&m, 0, sizeof(Material));
+    m.color.value = (Vec3){0.8, 0.8, 0.8};
+    compile_material(&m);
+    expect(m.shading, SHADE_DIFFUSE, "a constant diffuse material");
+    m.specular.value = (Vec3){0.5, 0.5, 0.5};
+    compile_material(&m);
+    expect(m.shading, SHADE_GLOSSY, "a constant glossy material");
+    m.metallic.value = (Vec3){1, 1, 1};
+    compile_material(&m);
+    expect(m.shading, SHADE_METALLIC, "a constant metallic material");
+    m.emissive.value = (Vec3){5, 5, 5};
+    compile_material(&m);
+    expect(m.shading, SHADE_EMISSIVE, "a constant light");
+
+    if (failures > 0) {
+        fprintf(stderr, "Error: %d shading class checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("shading class test passed\n");
+    return EXIT_SUCCESS;
+}
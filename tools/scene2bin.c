@@ -0,0 +1,18 @@
+#include <stdio.h>
+#include "binaryScene.h"
+
+/* converts an obj/mtl scene with its textures into the binary scene format of the renderer.
+Texture paths in the mtl file are resolved like the renderer does, relative to scene/ */
+int main(int argc, char **argv) {
+    if (argc != 4) {
+        fprintf(stderr, "Usage: %s scene.obj scene.mtl out.ttscene\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    Materials mats;
+    Triangles triangles;
+    load_obj_scene(argv[1], argv[2], &triangles, &mats);
+    write_binary_scene(argv[3], &triangles, &mats);
+    free_triangles(&triangles);
+    free_materials(mats);
+    return 0;
+}